@@ -0,0 +1,53 @@
+// Reference echo server for netyo_loadgen.
+// usage: echo_server [port | unix-path] [threads] [cert.pem key.pem]
+#include "net/Server.h"
+#include "net/Transport.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <functional>
+
+using namespace std;
+using namespace std::placeholders;
+
+int main(int argc, char* argv[]) {
+    string where = argc > 1 ? argv[1] : "9000";
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    // peers going away while responses are written are expected
+    ::signal(SIGPIPE, SIG_IGN);
+    ThreadingEventLoop loop {threads + 1, "echo"};
+
+    TcpTransport::Protocol protocol {
+        {},
+        [](Transport & conn) {
+            char data[16384];
+            while (ssize_t len = conn.rbuffer.drain_rbuffer(data, sizeof(data)))
+                conn.send(data, len);
+        },
+        {}, {}, {},
+        [](Transport & conn) { conn.close(); }
+    };
+
+    TcpServer server{
+        where[0] == '/' || where[0] == '@'
+            ? InetAddr::unix_path(where)
+            : InetAddr("0.0.0.0", static_cast<uint16_t>(atoi(where.c_str()))),
+        bind(&ThreadingEventLoop::get_loop, &loop, _1),
+        0s,
+        &protocol
+    };
+#if NETYO_TLS
+    if (argc > 4) {
+        auto tls = TlsContext::server_context(argv[3], argv[4]);
+        if (!tls)
+            return 1;
+        server.set_tls(tls);
+    }
+#endif
+    server();
+    cout << "Listening: " << server.get_socket() << endl;
+    loop.wait();
+
+    return 0;
+}
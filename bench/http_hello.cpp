@@ -0,0 +1,64 @@
+// Reference keep-alive http server for netyo_loadgen, answers every request
+// with a fixed response.
+// usage: http_hello [port] [threads]
+#include "net/Server.h"
+#include "net/Transport.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <iostream>
+#include <functional>
+
+using namespace std;
+using namespace std::placeholders;
+
+// length of the request head at the front of the buffer, 0 if incomplete
+static ssize_t request_length(Buffer & rbuffer) {
+    for (ssize_t i = 3; i < rbuffer.size(); ++i) {
+        if (rbuffer[i] == '\n' && rbuffer[i - 1] == '\r'
+            && rbuffer[i - 2] == '\n' && rbuffer[i - 3] == '\r')
+            return i + 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 8080;
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    // peers going away while responses are written are expected
+    ::signal(SIGPIPE, SIG_IGN);
+    ThreadingEventLoop loop {threads + 1, "http"};
+
+    static const string response =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 13\r\n"
+        "\r\n"
+        "Hello, World!";
+
+    // requests have no body, pipelined ones are answered in order
+    TcpTransport::Protocol protocol {
+        {},
+        [](Transport & conn) {
+            char head[4096];
+            while (ssize_t len = request_length(conn.rbuffer)) {
+                while (len > 0)
+                    len -= conn.rbuffer.drain_rbuffer(head, min<ssize_t>(len, sizeof(head)));
+                conn.send(response.data(), response.size());
+            }
+        },
+        {}, {}, {},
+        [](Transport & conn) { conn.close(); }
+    };
+
+    TcpServer server{
+        {"0.0.0.0", static_cast<uint16_t>(port)},
+        bind(&ThreadingEventLoop::get_loop, &loop, _1),
+        0s,
+        &protocol
+    };
+    server();
+    cout << "Listening: " << server.get_socket() << endl;
+    loop.wait();
+
+    return 0;
+}
@@ -0,0 +1,465 @@
+// Drives connections against a server from a ThreadingEventLoop and reports
+// throughput and latency percentiles.
+//
+// usage: netyo_loadgen [options] ip port | unix-path
+//   -c connections  over all loops(64)
+//   -t threads      loops(4)
+//   -d seconds      measured duration(10)
+//   -r rate         requests per second over all connections. 0 runs a closed
+//                   loop, a connection sends its next request as soon as the
+//                   response arrived(0)
+//   -m echo|http|udp
+//                   echo sends -s bytes and waits for them to come back, http
+//                   sends keep-alive GET requests, udp sends a datagram of -s
+//                   bytes per request from a connected socket(echo)
+//   -s bytes        echo payload(64)
+//   -k              TLS without verifying the server(echo and http)
+//   -e elephants    extra echo connections streaming with 1MiB in flight,
+//                   not measured, e.g. for the latency of the others next to
+//                   them(0)
+//   -T milliseconds request timeout, a request without a response by then
+//                   counts as an error, udp sends the next one and tcp
+//                   replaces the connection(2000)
+//
+// With a rate every connection sends on a fixed schedule and latencies are
+// measured from the scheduled time instead of the actual send time, so the
+// requests held up by a stalled server are charged to it as well(coordinated
+// omission correction). Timed out requests are charged with the timeout in
+// that case.
+#include "net/Client.h"
+#include "net/UdpTransport.h"
+#include "utils/Metrics.h"
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace chrono;
+
+
+struct Options {
+    size_t connections = 64;
+    int threads = 4;
+    seconds duration = 10s;
+    double rate = 0;
+    bool http = false, udp = false;
+    size_t size = 64;
+    size_t elephants = 0;
+    milliseconds timeout = 2000ms;
+#if NETYO_TLS
+    shared_ptr<TlsContext> tls;
+#endif
+};
+
+
+// All the connections of one loop, only touched within the loop's thread.
+class Worker : public NoCopyble {
+private:
+    struct Conn {
+        shared_ptr<Transport> transport;
+        // of the request in flight, scheduled(open loop) or actual send time
+        Time start;
+        Time next_send;
+        bool in_flight = false;
+        // of the request in flight, unique within the worker unlike the
+        // transport's address
+        uint64_t seq = 0;
+        TimerId timeout = 0;
+        // echo bytes received so far
+        size_t received = 0;
+        // http response bytes not parsed yet
+        string pending;
+        // streams instead of sending requests
+        bool elephant = false;
+    };
+    // bytes an elephant keeps in flight
+    static constexpr size_t ELEPHANT_WINDOW = 1 << 20;
+
+    EventLoop* loop;
+    const Options & options;
+    atomic<size_t> & settled;
+    InetAddr addr;
+    string request;
+    // what elephants send, one read's worth
+    string stream = string(16384, 'e');
+    // per connection, 0 in a closed loop
+    nanoseconds interval {0};
+    TcpTransport::Protocol protocol;
+    UdpTransport::Protocol udp_protocol;
+    TcpClient client;
+    unordered_map<Transport*, Conn> conns;
+    uint64_t requests = 0;
+    bool running = true, measuring = false;
+
+    void send(Conn & conn, const Time & start) {
+        conn.start = start;
+        conn.in_flight = true;
+        conn.received = 0;
+        conn.seq = ++requests;
+        // datagrams carry the sequence, late responses to a timed out
+        // request are told apart from the current one
+        if (options.udp && request.size() >= sizeof(conn.seq))
+            memcpy(request.data(), &conn.seq, sizeof(conn.seq));
+        conn.transport->send(request.data(), request.size());
+        conn.timeout = loop->call_later([this, key = conn.transport.get(), seq = conn.seq]() {
+            auto it = conns.find(key);
+            if (it != conns.end() && it->second.in_flight && it->second.seq == seq)
+                timeout(it->second);
+        }, options.timeout);
+    }
+
+    void schedule(Conn & conn) {
+        auto now = EventLoop::precise_now();
+        if (interval == 0ns) {
+            send(conn, now);
+        }
+        else if (conn.next_send <= now) {
+            // behind the schedule, the time lost is part of the latency
+            auto start = conn.next_send;
+            conn.next_send += interval;
+            send(conn, start);
+        }
+        else {
+            loop->call_at([this, key = conn.transport.get()]() {
+                auto it = conns.find(key);
+                if (running && it != conns.end() && !it->second.in_flight)
+                    schedule(it->second);
+            }, conn.next_send);
+        }
+    }
+
+    bool response_complete(Conn & conn, Buffer & rbuffer) {
+        char data[16384];
+        if (!options.http) {
+            while (ssize_t len = rbuffer.drain_rbuffer(data, sizeof(data)))
+                conn.received += len;
+            return conn.received >= request.size();
+        }
+        while (ssize_t len = rbuffer.drain_rbuffer(data, sizeof(data)))
+            conn.pending.append(data, len);
+        size_t head = conn.pending.find("\r\n\r\n");
+        if (head == string::npos)
+            return false;
+        size_t body = 0, pos = conn.pending.find("Content-Length:");
+        if (pos != string::npos && pos < head)
+            body = strtoul(conn.pending.c_str() + pos + 15, nullptr, 10);
+        if (conn.pending.size() < head + 4 + body)
+            return false;
+        conn.pending.erase(0, head + 4 + body);
+        return true;
+    }
+
+    void on_data(Transport & transport) {
+        auto it = conns.find(&transport);
+        if (it == conns.end())
+            return;
+        auto & conn = it->second;
+        if (conn.elephant) {
+            // whatever came back goes out again
+            char data[16384];
+            while (ssize_t len = transport.rbuffer.drain_rbuffer(data, sizeof(data)))
+                transport.send(stream.data(), len);
+            return;
+        }
+        if (conn.in_flight && response_complete(conn, transport.rbuffer))
+            complete(conn);
+    }
+
+    void on_datagrams(Transport & transport, const Datagram * datagrams, size_t num) {
+        auto it = conns.find(&transport);
+        if (it == conns.end() || !it->second.in_flight)
+            return;
+        auto & conn = it->second;
+        bool tagged = request.size() >= sizeof(conn.seq);
+        for (size_t i = 0; i < num; ++i) {
+            if (tagged && (datagrams[i].len < sizeof(conn.seq)
+                           || memcmp(datagrams[i].data, &conn.seq, sizeof(conn.seq))))
+                continue;
+            conn.received += datagrams[i].len;
+        }
+        if (conn.received >= request.size())
+            complete(conn);
+    }
+
+    void complete(Conn & conn) {
+        conn.in_flight = false;
+        loop->cancel(conn.timeout);
+        if (measuring) {
+            latency.record(duration_cast<nanoseconds>(
+                EventLoop::precise_now() - conn.start).count());
+            completed.inc();
+        }
+        if (running)
+            schedule(conn);
+    }
+
+    void timeout(Conn & conn) {
+        conn.in_flight = false;
+        if (measuring) {
+            errors.inc();
+            if (interval > 0ns)
+                latency.record(duration_cast<nanoseconds>(
+                    EventLoop::precise_now() - conn.start).count());
+        }
+        if (!running)
+            return;
+        if (options.udp) {
+            schedule(conn);
+            return;
+        }
+        // whatever is still in the stream belongs to the lost request, a
+        // new connection takes over the schedule
+        auto transport = move(conn.transport);
+        auto next_send = conn.next_send;
+        conns.erase(transport.get());
+        transport->force_close();
+        connect(next_send, false);
+    }
+
+    void connect(const Time & next_send, bool initial) {
+        client.connect([this, next_send, initial](shared_ptr<Transport> transport, int error) {
+            if (initial)
+                settled++;
+            if (error) {
+                connect_errors.inc();
+                last_error = error;
+                return;
+            }
+            auto & conn = conns[transport.get()];
+            conn.transport = move(transport);
+            conn.next_send = next_send;
+            schedule(conn);
+        });
+    }
+
+    void on_lost(Transport & transport) {
+        auto it = conns.find(&transport);
+        if (it == conns.end())
+            return;
+        bool elephant = it->second.elephant;
+        if (it->second.in_flight)
+            loop->cancel(it->second.timeout);
+        conns.erase(it);
+        if (running && measuring && !elephant)
+            errors.inc();
+    }
+
+public:
+    LatencyHistogram latency;
+    Counter completed, errors, connect_errors;
+    int last_error = 0;
+
+    Worker(EventLoop* loop, const Options & options, const InetAddr & addr,
+           atomic<size_t> & settled)
+        : loop(loop),
+          options(options),
+          settled(settled),
+          addr(addr),
+          protocol{
+              {},
+              [this](Transport & conn) { on_data(conn); },
+              {}, {}, {},
+              [](Transport & conn) { conn.close(); },
+              [this](Transport & conn) { on_lost(conn); }
+          },
+          udp_protocol{
+              [this](UdpTransport & conn, const Datagram * datagrams, size_t num) {
+                  on_datagrams(conn, datagrams, num);
+              },
+              {},
+              [this](Transport & conn) { on_lost(conn); }
+          },
+          client(loop, addr, 0s, &protocol) {
+#if NETYO_TLS
+        if (options.tls)
+            client.set_tls(options.tls);
+#endif
+        if (options.http)
+            request = "GET / HTTP/1.1\r\nHost: netyo\r\n\r\n";
+        else
+            request.assign(options.size, 'x');
+    }
+
+    // within the loop's thread, connections first to first + num - 1 of all
+    void start(size_t first, size_t num) {
+        if (options.rate > 0)
+            interval = duration_cast<nanoseconds>(
+                duration<double>(options.connections / options.rate));
+        auto begin = EventLoop::precise_now();
+        for (size_t i = first; i < first + num; ++i) {
+            if (options.udp) {
+                auto socket = Socket::udp_socket({addr.is_ipv4() ? "0.0.0.0" : "::", 0});
+                settled++;
+                if (socket.connect(addr) < 0) {
+                    connect_errors.inc();
+                    last_error = errno;
+                    continue;
+                }
+                auto transport = make_shared<UdpTransport>(loop, move(socket), &udp_protocol);
+                transport->activate();
+                auto & conn = conns[transport.get()];
+                conn.transport = move(transport);
+                conn.next_send = begin + interval * i / options.connections;
+                schedule(conn);
+                continue;
+            }
+            // spread the schedules of the connections over one interval
+            connect(begin + interval * i / options.connections, true);
+        }
+    }
+
+    // within the loop's thread, after start()
+    void start_elephants(size_t num) {
+        for (size_t i = 0; i < num; ++i) {
+            client.connect([this](shared_ptr<Transport> transport, int error) {
+                settled++;
+                if (error) {
+                    connect_errors.inc();
+                    last_error = error;
+                    return;
+                }
+                auto & conn = conns[transport.get()];
+                conn.transport = move(transport);
+                conn.elephant = true;
+                for (size_t sent = 0; sent < ELEPHANT_WINDOW; sent += stream.size())
+                    conn.transport->send(stream.data(), stream.size());
+            });
+        }
+    }
+
+    void measure() {
+        measuring = true;
+    }
+
+    void stop() {
+        running = false;
+        measuring = false;
+        vector<shared_ptr<Transport>> transports;
+        for (auto & [key, conn] : conns) {
+            if (conn.in_flight)
+                loop->cancel(conn.timeout);
+            transports.push_back(conn.transport);
+        }
+        conns.clear();
+        for (auto & transport : transports)
+            transport->force_close();
+    }
+};
+
+
+static void usage(const char * name) {
+    fprintf(stderr, "usage: %s [-c connections] [-t threads] [-d seconds] "
+                    "[-r rate] [-m echo|http|udp] [-s bytes] [-k] [-e elephants] "
+                    "[-T milliseconds] "
+                    "ip port | unix-path\n", name);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    int opt;
+    while ((opt = ::getopt(argc, argv, "c:t:d:r:m:s:ke:T:")) != -1) {
+        switch (opt) {
+            case 'c': options.connections = strtoul(optarg, nullptr, 10); break;
+            case 't': options.threads = atoi(optarg); break;
+            case 'd': options.duration = seconds(atoi(optarg)); break;
+            case 'r': options.rate = atof(optarg); break;
+            case 'm':
+                options.http = string(optarg) == "http";
+                options.udp = string(optarg) == "udp";
+                break;
+            case 's': options.size = strtoul(optarg, nullptr, 10); break;
+            case 'e': options.elephants = strtoul(optarg, nullptr, 10); break;
+            case 'T': options.timeout = milliseconds(atoi(optarg)); break;
+#if NETYO_TLS
+            case 'k': options.tls = TlsContext::client_context(false); break;
+#endif
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2
+        || !options.connections || options.threads <= 0 || !options.size
+        || options.timeout <= 0ms
+        || (options.elephants && (options.http || options.udp)))
+        usage(argv[0]);
+    // a single path argument is a unix domain socket, '@' for abstract ones
+    InetAddr addr = argc - optind == 1
+                  ? InetAddr::unix_path(argv[optind])
+                  : InetAddr(argv[optind], static_cast<uint16_t>(atoi(argv[optind + 1])));
+
+    ::signal(SIGPIPE, SIG_IGN);
+    ThreadingEventLoop pool {options.threads, "loadgen"};
+    auto loops = pool.loops();
+    atomic<size_t> settled {0};
+    vector<unique_ptr<Worker>> workers;
+    size_t first = 0;
+    for (size_t i = 0; i < loops.size(); ++i) {
+        size_t num = options.connections / loops.size()
+                   + (i < options.connections % loops.size());
+        auto worker = workers.emplace_back(
+            new Worker(loops[i], options, addr, settled)).get();
+        size_t elephants = options.elephants / loops.size()
+                         + (i < options.elephants % loops.size());
+        loops[i]->call_soon([worker, first, num, elephants]() {
+            worker->start(first, num);
+            worker->start_elephants(elephants);
+        });
+        first += num;
+    }
+    for (auto deadline = steady_clock::now() + 10s;
+         settled < options.connections + options.elephants
+         && steady_clock::now() < deadline; )
+        this_thread::sleep_for(10ms);
+
+    // the window starts once every connection is up and running
+    for (size_t i = 0; i < loops.size(); ++i)
+        loops[i]->call_soon([worker = workers[i].get()]() { worker->measure(); });
+    auto begin = steady_clock::now();
+    this_thread::sleep_for(options.duration);
+    for (size_t i = 0; i < loops.size(); ++i) {
+        promise<void> stopped;
+        loops[i]->call_soon([worker = workers[i].get(), &stopped]() {
+            worker->stop();
+            stopped.set_value();
+        });
+        stopped.get_future().wait();
+    }
+    double elapsed = duration<double>(steady_clock::now() - begin).count();
+    pool.close();
+
+    LatencyHistogram::Snapshot latency;
+    uint64_t completed = 0, errors = 0, connect_errors = 0;
+    int last_error = 0;
+    for (auto & worker : workers) {
+        latency.merge(worker->latency);
+        completed += worker->completed.value();
+        errors += worker->errors.value();
+        connect_errors += worker->connect_errors.value();
+        if (worker->last_error)
+            last_error = worker->last_error;
+    }
+    if (connect_errors)
+        fprintf(stderr, "%lu connections failed, last error: %s\n",
+                static_cast<unsigned long>(connect_errors), strerror(last_error));
+    auto us = [&latency](double q) { return latency.percentile(q) / 1e3; };
+    printf("%zu connections, %zu loops, %.2fs, %s\n",
+           options.connections, loops.size(), elapsed,
+           options.rate > 0 ? ("open loop at " + to_string(options.rate) + " req/s").c_str()
+                            : "closed loop");
+    printf("requests %lu, errors %lu, throughput %.1f req/s\n",
+           static_cast<unsigned long>(completed), static_cast<unsigned long>(errors),
+           completed / elapsed);
+    printf("latency(us) mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+           latency.count() ? latency.sum() / 1e3 / latency.count() : 0.0,
+           us(0.5), us(0.9), us(0.99), us(0.999), latency.max() / 1e3);
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+// Reference udp echo server for netyo_loadgen -m udp, every worker loop reads
+// its own socket bound to the shared port.
+// usage: udp_echo [port] [threads] [gso] [gro]
+#include "net/UdpTransport.h"
+#include <stdlib.h>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 9001;
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    UdpTransport::Options options;
+    options.gso = argc > 3 && atoi(argv[3]);
+    options.gro = argc > 4 && atoi(argv[4]);
+    ThreadingEventLoop loop {threads, "udp"};
+
+    UdpTransport::Protocol protocol {
+        [](UdpTransport & conn, const Datagram * datagrams, size_t num) {
+            for (size_t i = 0; i < num; ++i)
+                conn.send_to(datagrams[i].data, datagrams[i].len, datagrams[i].peer);
+        }
+    };
+
+    vector<shared_ptr<UdpTransport>> transports;
+    for (auto worker : loop.loops()) {
+        auto & transport = transports.emplace_back(make_shared<UdpTransport>(
+            worker, Socket::udp_socket({"0.0.0.0", static_cast<uint16_t>(port)}),
+            &protocol, options));
+        transport->activate();
+    }
+    cout << "Listening: " << transports.front()->get_socket() << endl;
+    loop.wait();
+
+    return 0;
+}
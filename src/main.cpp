@@ -1,6 +1,9 @@
 #include "net/Server.h"
 #include "net/Transport.h"
+#include "net/HotRestart.h"
+#include "net/MetricsServer.h"
 #include <chrono>
+#include <future>
 #include <iostream>
 #include <functional>
 
@@ -27,28 +30,48 @@ Connection: Close
         [](auto pconn) {
             // cout << "Connection " << pconn->get_socket() << " made!" << endl;
         },
-        [&rsp_msg](auto pconn) {
-            auto [rit, red] = pconn->rbuffer.reader();
+        [&rsp_msg](Transport & conn) {
+            auto [rit, red] = conn.rbuffer.reader();
             string msg(rit, red);
             // cout << "Received Message" <<  msg << endl;
             // cout << "Sending back..." << endl;
-            pconn->send(rsp_msg.data(), rsp_msg.size());
-            pconn->close();
+            conn.send(rsp_msg.data(), rsp_msg.size());
+            conn.close();
         }, {}, {}, {}, {},
         [](auto pconn) {
             // cout << "Conection " << pconn->get_socket() << " closed!" << endl;
         }
     };
     
-    TcpServer server{
-        {"0.0.0.0", 44567}, 
-        bind(&ThreadingEventLoop::get_loop, &loop, _1), 
-        1min,
-        &protocol
-    };
-    server();
-    cout << "Listening: " << server.get_socket() << endl;
-    loop.wait();
+    // a restarted server takes the listening socket over from the running
+    // one, which then drains its connections and exits.
+    const string handoff_path = "/tmp/netyo-44567.sock";
+    promise<void> drained;
+    {
+        auto inherited = HotRestart::inherit(handoff_path);
+        TcpServer server{
+            HotRestart::take_listener(inherited, {"0.0.0.0", 44567}), 
+            bind(&ThreadingEventLoop::get_loop, &loop, _1), 
+            1min,
+            &protocol
+        };
+        server();
+        cout << "Listening: " << server.get_socket() << endl;
+
+        // prometheus metrics on a local admin port
+        MetricsServer admin{loop, {"127.0.0.1", 44568}, [&server](auto & snapshot) {
+            server.collect(snapshot);
+        }};
+        admin();
+
+        HotRestart restart(loop.get_loop(true), handoff_path);
+        restart.serve({server.get_socket().fd()}, [&server, &drained]() {
+            server.drain(30s, [&drained]() { drained.set_value(); });
+        });
+        drained.get_future().wait();
+    }
+    // the servers are gone while the loops still run, then the loops stop
+    loop.close();
 
     return 0;
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include <bits/c++config.h>
 #include <vector>
+#include <deque>
 #include <type_traits>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -10,6 +11,8 @@
 #include <cstring>
 #include <iostream>
 #include <array>
+#include "../utils/Metrics.h"
+#include "../utils/Logging.h"
 
 using namespace std;
 
@@ -25,6 +28,8 @@ protected:
 
 public:
     RingBuffer() : vec(7) {}
+    // reuses the storage, the content is discarded
+    explicit RingBuffer(Sequence && storage) : vec(move(storage)) {}
     explicit RingBuffer(size_t count, const T & value = T())
     : vec(max((size_t)7, count), value) {}
     template <typename InputIt>
@@ -55,12 +60,16 @@ public:
     void reserve(ssize_t len) {
         if (len + 1 <= vec.size())
             return;
-        bool need_tranfer = !(lo <= hi);
-        vec.resize(len + 1);
-        if (need_tranfer) {
-            copy(vec.begin(), vec.begin() + hi, vec.begin() + lo);
-            hi = lo + hi;
+        if (lo <= hi) {
+            vec.resize(len + 1);
+            return;
         }
+        // linearize the wrapped content
+        Sequence tmp(len + 1);
+        auto it = copy(vec.begin() + lo, vec.end(), tmp.begin());
+        copy(vec.begin(), vec.begin() + hi, it);
+        hi = size(); lo = 0;
+        vec.swap(tmp);
     }
     void expand() { reserve(2 * capacity()); }
     void ensure_space(ssize_t len) { reserve(size() + len); }
@@ -246,14 +255,140 @@ public:
 };
 
 
+// Allocated and transferred bytes are accounted to the metrics of the
+// loop(thread) using the buffer. Buffers built or destroyed elsewhere, e.g.
+// those of connections a server loop hands to its workers, are only
+// accounted while owned, see own() and disown(). The storage of destroyed buffers is kept
+// per thread and handed to the next ones, so short lived connections do not
+// allocate and grow their buffers over and over again.
 class Buffer : public RingBuffer<char> {
+private:
+    static constexpr ssize_t RECYCLE_MAX_SIZE = 16 * 1024;
+    static constexpr ssize_t RECYCLE_MAX_BYTES = 8 << 20;
+
+    struct SpareStorage {
+        vector<vector<char>> storages;
+        ssize_t bytes = 0;
+        ~SpareStorage();
+    };
+    static SpareStorage& spare_storage() {
+        static thread_local SpareStorage spare;
+        return spare;
+    }
+    // trivially destructible, still readable after the storage is destroyed
+    static bool& spare_alive() {
+        static thread_local bool alive = true;
+        return alive;
+    }
+
+    static vector<char> take_storage() {
+        if (!spare_alive())
+            return vector<char>(7);
+        auto & spare = spare_storage();
+        if (spare.storages.empty())
+            return vector<char>(7);
+        auto storage = move(spare.storages.back());
+        spare.storages.pop_back();
+        spare.bytes -= storage.size();
+        return storage;
+    }
+
+    static ssize_t recv_fds(int fd, iovec * iov, int iovcnt, vector<int> & fds) {
+        // up to 64 fds per message, the kernel drops the rest(MSG_CTRUNC)
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 64)];
+        msghdr msg {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t res = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (res < 0)
+            return res;
+        for (cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t prev = fds.size();
+            fds.resize(prev + n);
+            ::memcpy(fds.data() + prev, CMSG_DATA(cmsg), sizeof(int) * n);
+        }
+        if (msg.msg_flags & MSG_CTRUNC)
+            LOG(WARN) << "Passed fds dropped on fd " << fd << ", too many at once";
+        return res;
+    }
+
+    void account(ssize_t prev_vsize) {
+        if (accounted && vsize() != prev_vsize)
+            LoopMetrics::local().buffer_bytes.add(vsize() - prev_vsize);
+    }
+
+    // bytes appended by feed_wbuffer()/commit() so far
+    uint64_t fed = 0;
+    // vsize() is part of the calling thread's LoopMetrics::buffer_bytes
+    bool accounted = true;
+
 public:
-    ssize_t feed_rbuffer(int fd) {
+    Buffer() : RingBuffer<char>(take_storage()) {
+        account(0);
+    }
+    Buffer(const Buffer & other) : RingBuffer<char>(other) {
+        account(0);
+    }
+    ~Buffer() {
+        if (accounted)
+            LoopMetrics::local().buffer_bytes.add(-vsize());
+        if (!spare_alive())
+            return;
+        auto & spare = spare_storage();
+        if (vsize() <= RECYCLE_MAX_SIZE && spare.bytes + vsize() <= RECYCLE_MAX_BYTES) {
+            spare.bytes += vsize();
+            spare.storages.push_back(move(vec));
+        }
+    }
+
+    // within the thread of the loop taking the buffer over, its bytes are
+    // accounted there from now on
+    void own() {
+        if (!accounted) {
+            accounted = true;
+            LoopMetrics::local().buffer_bytes.add(vsize());
+        }
+    }
+    // within the thread accounting it, e.g. before the buffer is handed to
+    // another loop or destroyed away from its loop
+    void disown() {
+        if (accounted) {
+            accounted = false;
+            LoopMetrics::local().buffer_bytes.add(-vsize());
+        }
+    }
+
+    // gives the storage of an empty buffer grown above RECYCLE_MAX_SIZE back,
+    // e.g. under memory pressure. Returns the bytes released.
+    ssize_t shrink() {
+        if (!empty() || vsize() <= RECYCLE_MAX_SIZE)
+            return 0;
+        ssize_t prev_vsize = vsize();
+        vector<char>(7).swap(vec);
+        lo = hi = 0;
+        account(prev_vsize);
+        return prev_vsize - vsize();
+    }
+
+    // With fds, the fds passed along(SCM_RIGHTS) are appended to it. Every
+    // read has min_space bytes free at least and its size is appended to
+    // sizes, e.g. for whole SOCK_SEQPACKET messages. Reads stop at EAGAIN or
+    // once max_bytes(0 for no limit) are read, messages are never cut.
+    ssize_t feed_rbuffer(int fd, vector<int> * fds = nullptr, ssize_t min_space = 0,
+                         deque<size_t> * sizes = nullptr, ssize_t max_bytes = 0) {
         ssize_t bytes_feed = 0, total = 0;
         size_t len1, len2;
         do {
-            if (capacity() - size() <= (capacity() >> 2)) {
-                expand();
+            if (capacity() - size() <= (capacity() >> 2)
+                || capacity() - size() < min_space) {
+                ssize_t prev_vsize = vsize();
+                reserve(max(2 * capacity(), size() + min_space));
+                account(prev_vsize);
             }
             if (lo <= hi) {
                 len1 = vsize() - hi; len2 = lo;
@@ -261,17 +396,28 @@ public:
             else {
                 len1 = lo - hi; len2 = 0;
             }
-            if (len1 > 0)  len1 -= 1;
-            else           len2 -= 1; // keep the ring buffer not oversized
+            if (len2 > 0)  len2 -= 1;
+            else           len1 -= 1; // keep the ring buffer not oversized
+            if (max_bytes && !sizes) {
+                size_t left = max_bytes - total;
+                len1 = min(len1, left);
+                len2 = min(len2, left - len1);
+            }
             iovec iovec[2] {{vec.data() + hi, len1}, {vec.data(), len2}};
-            bytes_feed = ::readv(fd, iovec, len2 > 0 ? 2 : 1);
+            bytes_feed = fds ? recv_fds(fd, iovec, len2 > 0 ? 2 : 1, *fds)
+                             : ::readv(fd, iovec, len2 > 0 ? 2 : 1);
             if (bytes_feed > 0) {
                 hi = MOD(hi + bytes_feed);
                 total += bytes_feed;
+                if (sizes)
+                    sizes->push_back(bytes_feed);
             }
-        } while (bytes_feed > 0);
+        } while (bytes_feed > 0 && (!max_bytes || total < max_bytes));
 
-        return total;
+        if (total > 0)
+            LoopMetrics::local().bytes_read.inc(total);
+        // 0 for eof, -1 with errno(EAGAIN included) if nothing was read
+        return total > 0 ? total : bytes_feed;
     }
     
     ssize_t drain_wbuffer(int fd) {
@@ -294,13 +440,48 @@ public:
             if (wn < 0) return wn; bytes_drain += wn;
         }
         lo = MOD(lo + bytes_drain);
+        LoopMetrics::local().bytes_written.inc(bytes_drain);
         return remain_size - bytes_drain;
     }
     
+    // sockets only, both parts in one sendmsg() with MSG_NOSIGNAL | flags.
+    // At most limit(if not negative) bytes are sent, together with the
+    // control message if any. Returns the bytes left like drain_wbuffer().
+    ssize_t send_wbuffer(int fd, int flags = 0, ssize_t limit = -1,
+                         void * control = nullptr, size_t controllen = 0) {
+        if (size() <= 0) return 0;
+        ssize_t remain_size = size();
+        size_t len1, len2;
+        if (lo < hi) {
+            len1 = hi - lo; len2 = 0;
+        }
+        else {
+            len1 = vsize() - lo; len2 = hi;
+        }
+        if (limit >= 0) {
+            len1 = min<size_t>(len1, limit);
+            len2 = min<size_t>(len2, limit - len1);
+        }
+        iovec iovec[2] {{vec.data() + lo, len1}, {vec.data(), len2}};
+        msghdr msg {};
+        msg.msg_iov = iovec;
+        msg.msg_iovlen = len2 ? 2 : 1;
+        msg.msg_control = control;
+        msg.msg_controllen = controllen;
+        ssize_t wn = ::sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+        if (wn < 0) return wn;
+        lo = MOD(lo + wn);
+        LoopMetrics::local().bytes_written.inc(wn);
+        return remain_size - wn;
+    }
+
     ssize_t feed_wbuffer(const void* data, ssize_t len) {
         if (len <= 0) return 0;
+        fed += len;
+        ssize_t prev_vsize = vsize();
         ensure_space(len);
-        if (hi <= lo) {
+        account(prev_vsize);
+        if (hi < lo) {
             memcpy(vec.data() + hi, data, len);
         }
         else {
@@ -316,6 +497,42 @@ public:
         return len;
     }
 
+    // offsets into the stream written through the buffer, begin_offset()
+    // is the one of front()
+    uint64_t end_offset() const { return fed; }
+    uint64_t begin_offset() const { return fed - size(); }
+
+    // the contiguous bytes at the front, consume() what has been used of it
+    pair<const char*, ssize_t> peek() const {
+        return {vec.data() + lo, lo <= hi ? hi - lo : vsize() - lo};
+    }
+    // copies up to len bytes from the front without consuming them
+    ssize_t peek(void* data, ssize_t len) const {
+        len = min(len, size());
+        ssize_t len1 = min(vsize() - lo, len);
+        memcpy(data, vec.data() + lo, len1);
+        if (len - len1 > 0)
+            memcpy(static_cast<char*>(data) + len1, vec.data(), len - len1);
+        return len;
+    }
+    void consume(ssize_t len) {
+        lo = MOD(lo + min(len, size()));
+    }
+    // the contiguous free room at the back after making room for len bytes,
+    // it's less when the content wraps around. commit() what was written.
+    pair<char*, ssize_t> prepare(ssize_t len) {
+        if (capacity() - size() < len) {
+            ssize_t prev_vsize = vsize();
+            reserve(size() + len);
+            account(prev_vsize);
+        }
+        return {vec.data() + hi, lo <= hi ? vsize() - hi - (lo == 0) : lo - hi - 1};
+    }
+    void commit(ssize_t len) {
+        hi = MOD(hi + len);
+        fed += len;
+    }
+
     ssize_t drain_rbuffer(void* data, ssize_t len) {
         if (len <= 0 || !size()) return 0;
         len = min(len, size());
@@ -323,7 +540,7 @@ public:
             memcpy(data, vec.data() + lo, len);
         }
         else {
-            int len1 = vsize() - lo;
+            ssize_t len1 = min(vsize() - lo, len);
             if (len1) {
                 memcpy(data, vec.data() + lo, len1);
             }
@@ -331,6 +548,11 @@ public:
                 memcpy((void*)((char*)data + len1), vec.data(), len - len1);
             }
         }
+        lo = MOD(lo + len);
         return len;
     }
 };
+
+inline Buffer::SpareStorage::~SpareStorage() {
+    spare_alive() = false;
+}
@@ -0,0 +1,349 @@
+#include "Client.h"
+#include "UnixTransport.h"
+#include "eventloop/Channel.h"
+#include "../utils/Pool.h"
+#include <sys/socket.h>
+#include <errno.h>
+#include <algorithm>
+
+using namespace std;
+
+
+/*********************************TcpClient**********************************/
+
+// Owns the socket until the non-blocking connect completes, fails or times out.
+class TcpClient::Connector {
+private:
+    EventLoop* loop;
+    chrono::seconds timeout;
+    TcpTransport::Protocol* protocol;
+    Channel::Protocol* transport_channel_protocol;
+#if NETYO_TLS
+    shared_ptr<TlsContext> tls;
+    string server_name;
+#endif
+    Socket socket;
+    Channel channel;
+    ConnectCallBack cb;
+    TimerId timer_id = 0;
+    bool timer_armed = false, done = false;
+    // keeps the connector alive while connecting
+    shared_ptr<Connector> self;
+
+    void handle_result() {
+        int error = socket.getsockerr();
+        finish(error ? error : ECONNREFUSED);
+    }
+
+public:
+    static Channel::Protocol channel_protocol;
+
+    Connector(const TcpClient & client, Socket && sock, ConnectCallBack cb)
+        : loop(client.loop),
+          timeout(client.timeout),
+          protocol(client.protocol),
+          transport_channel_protocol(client.channel_protocol),
+#if NETYO_TLS
+          tls(client.tls),
+          server_name(client.server_name),
+#endif
+          socket(move(sock)),
+          channel(socket.fd(), this, loop->selector.get(), &channel_protocol),
+          cb(move(cb)) {}
+
+    static void start(shared_ptr<Connector> connector, bool connected,
+                      const milliseconds & connect_timeout) {
+        if (connected) {
+            connector->finish(0);
+            return;
+        }
+        connector->self = connector;
+        connector->timer_id = connector->loop->call_later(
+            [wconnector = weak_ptr<Connector>(connector)]() {
+                if (auto sp = wconnector.lock())
+                    sp->finish(ETIMEDOUT);
+            }, connect_timeout);
+        connector->timer_armed = true;
+        connector->channel.enable(Channel::WRITE);
+    }
+
+    void handle_writable() {
+        finish(socket.getsockerr());
+    }
+
+    void handle_error() {
+        handle_result();
+    }
+
+    void finish(int error) {
+        if (done)
+            return;
+        done = true;
+        if (timer_armed)
+            loop->cancel(timer_id);
+        channel.destroy();
+        auto callback = move(cb);
+        // released when leaving, the channel tolerates it within its callback
+        auto keep = move(self);
+        if (error) {
+            socket.close();
+            callback(nullptr, error);
+            return;
+        }
+        shared_ptr<TcpTransport> conn;
+#if NETYO_TLS
+        if (tls) {
+            conn = allocate_shared<TlsTransport>(
+                PoolAllocator<TlsTransport>(),
+                loop, move(socket), timeout, protocol, transport_channel_protocol,
+                tls, server_name
+            );
+        }
+        else
+#endif
+        if (socket.local_addr().is_unix()) {
+            conn = allocate_shared<UnixTransport>(
+                PoolAllocator<UnixTransport>(),
+                loop, move(socket), timeout, protocol, transport_channel_protocol
+            );
+        }
+        else {
+            conn = allocate_shared<TcpTransport>(
+                PoolAllocator<TcpTransport>(),
+                loop, move(socket), timeout, protocol, transport_channel_protocol
+            );
+        }
+        conn->activate();
+        callback(move(conn), 0);
+    }
+};
+
+Channel::Protocol TcpClient::Connector::channel_protocol = {
+    {},
+    [](void * pthis) {
+        static_cast<Connector*>(pthis)->handle_writable();
+    },
+    [](void * pthis) {
+        static_cast<Connector*>(pthis)->handle_error();
+    },
+    [](void * pthis) {
+        static_cast<Connector*>(pthis)->handle_error();
+    }
+};
+
+TcpClient::TcpClient(
+    EventLoop* loop,
+    const InetAddr & peeraddr,
+    chrono::seconds timeout,
+    TcpTransport::Protocol* protocol,
+    Channel::Protocol* channel_protocol)
+    : loop(loop),
+      peeraddr(peeraddr),
+      timeout(timeout),
+      protocol(protocol),
+      channel_protocol(channel_protocol) {}
+
+void TcpClient::connect(ConnectCallBack cb, const milliseconds & connect_timeout) {
+    loop->call_soon([=, this]() {
+        auto socket = Socket::client_socket(peeraddr, socket_type);
+        if (socket.fd() < 0) {
+            cb(nullptr, errno);
+            return;
+        }
+        options.apply_client(socket);
+        int res = socket.connect(peeraddr);
+        if (res < 0 && errno != EINPROGRESS) {
+            cb(nullptr, errno);
+            return;
+        }
+        Connector::start(make_shared<Connector>(*this, move(socket), cb),
+                         res == 0, connect_timeout);
+    });
+}
+
+void TcpClient::set_socket_type(int type) {
+    socket_type = type;
+}
+
+void TcpClient::set_socket_options(const SocketOptions & options) {
+    this->options = options;
+}
+
+#if NETYO_TLS
+void TcpClient::set_tls(shared_ptr<TlsContext> context, const string & server_name) {
+    tls = move(context);
+    this->server_name = server_name;
+}
+#endif
+
+EventLoop* TcpClient::get_event_loop() const {
+    return loop;
+}
+
+const InetAddr & TcpClient::get_peeraddr() const {
+    return peeraddr;
+}
+
+/********************************UpstreamPool*********************************/
+
+// idle keep-alive connections must neither be closed by the peer nor have
+// unexpected data pending.
+static bool reusable_connection(const shared_ptr<Transport> & conn) {
+    if (!conn || !conn->activated())
+        return false;
+    char c;
+    ssize_t n = ::recv(conn->get_socket().fd(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+UpstreamPool::UpstreamPool(
+    EventLoop* loop,
+    const InetAddr & peeraddr,
+    TcpTransport::Protocol* protocol,
+    const Options & options)
+    : loop(loop),
+      options(options),
+      protocol(*protocol),
+      client(loop, peeraddr, 0s, &this->protocol) {
+    client.set_socket_options(options.socket_options);
+
+    auto conn_lost_cb = protocol->connection_lost_cb;
+    this->protocol.connection_lost_cb = [this, conn_lost_cb](auto pconn) {
+        if (conn_lost_cb)
+            conn_lost_cb(pconn);
+        remove_idle(pconn);
+    };
+}
+
+UpstreamPool::UpstreamPool(
+    EventLoop* loop,
+    const InetAddr & peeraddr,
+    TcpTransport::Protocol* protocol)
+    : UpstreamPool(loop, peeraddr, protocol, Options{}) {}
+
+UpstreamPool::~UpstreamPool() {
+    evict_idle();
+    for (auto & conn : busy) {
+        conn->force_close();
+    }
+}
+
+bool UpstreamPool::healthy() const {
+    return failures < options.max_failures || loop->now() >= retry_at;
+}
+
+size_t UpstreamPool::in_flight() const {
+    return busy.size() + connecting;
+}
+
+// the idle timeout is armed only while a connection sits in the idle list
+static void set_idle_timeout(const shared_ptr<Transport> & conn, chrono::seconds timeout) {
+    static_pointer_cast<TcpTransport>(conn)->set_timeout(timeout);
+}
+
+void UpstreamPool::lend(const AcquireCallBack & cb, shared_ptr<Transport> conn) {
+    set_idle_timeout(conn, 0s);
+    busy.insert(conn);
+    cb(move(conn), 0);
+}
+
+void UpstreamPool::acquire(AcquireCallBack cb) {
+    loop->assert_within_self_thread();
+    while (idle.size()) {
+        auto conn = move(idle.back());
+        idle.pop_back();
+        if (reusable_connection(conn)) {
+            lend(cb, move(conn));
+            return;
+        }
+        conn->force_close();
+    }
+    if (!healthy()) {
+        cb(nullptr, ECONNREFUSED);
+        return;
+    }
+    if (in_flight() >= options.max_in_flight) {
+        waiters.push_back(move(cb));
+        return;
+    }
+    connecting++;
+    client.connect([this, cb](auto conn, int error) {
+        on_connected(cb, move(conn), error);
+    }, options.connect_timeout);
+}
+
+void UpstreamPool::on_connected(AcquireCallBack cb, shared_ptr<Transport> conn, int error) {
+    connecting--;
+    if (error) {
+        if (++failures >= options.max_failures) {
+            // the upstream is unhealthy, so are its idle connections
+            retry_at = loop->now() + options.unhealthy_backoff;
+            evict_idle();
+        }
+        cb(nullptr, error);
+        serve_waiters();
+        return;
+    }
+    failures = 0;
+    lend(cb, move(conn));
+}
+
+void UpstreamPool::release(shared_ptr<Transport> conn, bool reusable) {
+    loop->assert_within_self_thread();
+    if (!busy.erase(conn))
+        return;
+    if (reusable && reusable_connection(conn)) {
+        if (waiters.size()) {
+            auto cb = move(waiters.front());
+            waiters.pop_front();
+            lend(cb, move(conn));
+            return;
+        }
+        if (idle.size() < options.max_idle) {
+            set_idle_timeout(conn, options.idle_timeout);
+            idle.push_back(move(conn));
+            return;
+        }
+    }
+    conn->force_close();
+    serve_waiters();
+}
+
+void UpstreamPool::serve_waiters() {
+    while (waiters.size()) {
+        if (healthy() && in_flight() >= options.max_in_flight)
+            break;
+        auto cb = move(waiters.front());
+        waiters.pop_front();
+        if (healthy())
+            acquire(move(cb));
+        else
+            cb(nullptr, ECONNREFUSED);
+    }
+}
+
+void UpstreamPool::remove_idle(const shared_ptr<Transport> & conn) {
+    auto it = find(idle.begin(), idle.end(), conn);
+    if (it != idle.end())
+        idle.erase(it);
+}
+
+void UpstreamPool::evict_idle() {
+    auto conns = move(idle);
+    idle.clear();
+    for (auto & conn : conns) {
+        conn->force_close();
+    }
+}
+
+size_t UpstreamPool::num_idle() const {
+    return idle.size();
+}
+
+size_t UpstreamPool::num_in_flight() const {
+    return in_flight();
+}
+
+size_t UpstreamPool::num_waiting() const {
+    return waiters.size();
+}
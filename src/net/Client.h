@@ -0,0 +1,125 @@
+#pragma once
+#include "Transport.h"
+#include "TlsTransport.h"
+#include "eventloop/ThreadingEventLoop.h"
+#include "../utils/Common.h"
+#include <memory>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+
+using namespace std;
+using namespace chrono;
+
+
+// Connects to one peer from one loop. The established connection is a
+// regular TcpTransport driven by the given protocol, a UnixTransport for
+// unix domain peers or a TlsTransport with set_tls().
+class TcpClient : public NoCopyble {
+public:
+    // conn is nullptr when error(errno value) is not 0
+    using ConnectCallBack = function<void(shared_ptr<Transport> conn, int error)>;
+
+protected:
+    class Connector;
+
+    EventLoop* loop;
+    InetAddr peeraddr;
+    chrono::seconds timeout;
+    TcpTransport::Protocol* protocol;
+    Channel::Protocol* channel_protocol;
+    int socket_type = SOCK_STREAM;
+    SocketOptions options;
+#if NETYO_TLS
+    shared_ptr<TlsContext> tls;
+    string server_name;
+#endif
+
+public:
+    TcpClient(
+        EventLoop* loop,
+        const InetAddr & peeraddr,
+        chrono::seconds timeout = 0s,
+        TcpTransport::Protocol* protocol = &TcpTransport::default_protocol,
+        Channel::Protocol* channel_protocol = &TcpTransport::default_channel_protocol);
+
+    void connect(ConnectCallBack cb,
+                 const milliseconds & connect_timeout = 3s);
+
+    // e.g. SOCK_SEQPACKET for unix domain peers
+    void set_socket_type(int type);
+    // set on every socket before connecting
+    void set_socket_options(const SocketOptions & options);
+#if NETYO_TLS
+    // connections are TlsTransports, server_name is sent as SNI and verified
+    void set_tls(shared_ptr<TlsContext> context, const string & server_name = "");
+#endif
+
+    EventLoop* get_event_loop() const;
+    const InetAddr & get_peeraddr() const;
+};
+
+
+// Keep-alive connections to one upstream owned by one loop, so none of
+// the bookkeeping needs locking. All methods must be called within the loop's
+// thread, connections are handed out to one user at a time and stay owned by
+// the pool until they are released, broken ones included.
+class UpstreamPool : public NoCopyble {
+public:
+    struct Options {
+        size_t max_idle = 16;
+        // connections handed out or connecting
+        size_t max_in_flight = 64;
+        milliseconds connect_timeout = 3s;
+        // connections left idle that long are closed by the loop's timing
+        // wheel, handed out ones never time out
+        chrono::seconds idle_timeout = 60s;
+        // consecutive connect failures before the upstream is unhealthy
+        size_t max_failures = 3;
+        milliseconds unhealthy_backoff = 5s;
+        SocketOptions socket_options;
+    };
+    using AcquireCallBack = TcpClient::ConnectCallBack;
+
+protected:
+    EventLoop* loop;
+    Options options;
+    TcpTransport::Protocol protocol;
+    TcpClient client;
+
+    vector<shared_ptr<Transport>> idle;
+    unordered_set<shared_ptr<Transport>> busy;
+    deque<AcquireCallBack> waiters;
+    size_t connecting = 0, failures = 0;
+    Time retry_at;
+
+    bool healthy() const;
+    size_t in_flight() const;
+    void lend(const AcquireCallBack & cb, shared_ptr<Transport> conn);
+    void on_connected(AcquireCallBack cb, shared_ptr<Transport> conn, int error);
+    void remove_idle(const shared_ptr<Transport> & conn);
+    void serve_waiters();
+    void evict_idle();
+
+public:
+    UpstreamPool(
+        EventLoop* loop,
+        const InetAddr & peeraddr,
+        TcpTransport::Protocol* protocol,
+        const Options & options);
+    UpstreamPool(
+        EventLoop* loop,
+        const InetAddr & peeraddr,
+        TcpTransport::Protocol* protocol = &TcpTransport::default_protocol);
+    ~UpstreamPool();
+
+    void acquire(AcquireCallBack cb);
+    // connections that are broken or left in an unknown protocol state must
+    // not be reused.
+    void release(shared_ptr<Transport> conn, bool reusable = true);
+
+    size_t num_idle() const;
+    size_t num_in_flight() const;
+    size_t num_waiting() const;
+};
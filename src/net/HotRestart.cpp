@@ -0,0 +1,132 @@
+#include "HotRestart.h"
+#include "../utils/Logging.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+using namespace std;
+
+
+static const uint32_t HANDOFF_MAGIC = 0x6e657479;
+
+struct HandoffHeader {
+    uint32_t magic;
+    uint32_t num_fds;
+};
+
+static sockaddr_un unix_addr(const string & path) {
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    ::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+Channel::Protocol HotRestart::channel_protocol = {
+    [](void * pthis) {
+        static_cast<HotRestart*>(pthis)->handle_accept();
+    }
+};
+
+HotRestart::HotRestart(EventLoop* loop, const string & path)
+    : loop(loop),
+      path(path),
+      listener(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+      channel(listener.fd(), this, loop->selector.get(), &channel_protocol) {}
+
+HotRestart::~HotRestart() {
+    close();
+}
+
+vector<Socket> HotRestart::inherit(const string & path, const milliseconds & timeout) {
+    vector<Socket> inherited;
+    Socket sock(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    timeval tv {
+        static_cast<time_t>(timeout.count() / 1000),
+        static_cast<suseconds_t>(timeout.count() % 1000 * 1000)
+    };
+    ::setsockopt(sock.fd(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    auto addr = unix_addr(path);
+    // no process to take over from
+    if (::connect(sock.fd(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        return inherited;
+
+    int fds[MAX_FDS];
+    size_t num = MAX_FDS;
+    HandoffHeader header {};
+    ssize_t res = sock.recv_fds(fds, num, &header, sizeof(header));
+    if (res != sizeof(header) || header.magic != HANDOFF_MAGIC || header.num_fds != num) {
+        LOG(ERROR) << "Invalid listener handoff from " << path << ", received " 
+                   << num << " fds";
+        for (size_t i = 0; i < num; ++i)
+            ::close(fds[i]);
+        return inherited;
+    }
+    for (size_t i = 0; i < num; ++i)
+        inherited.emplace_back(fds[i]);
+    return inherited;
+}
+
+Socket HotRestart::take_listener(vector<Socket> & inherited, const InetAddr & addr) {
+    for (auto it = inherited.begin(); it != inherited.end(); ++it) {
+        InetAddr local(it->getsockname());
+        if (local.family() == addr.family() && local.port() == addr.port()
+            && local.ip() == addr.ip()) {
+            Socket sock(move(*it));
+            inherited.erase(it);
+            return sock;
+        }
+    }
+    return Socket::server_socket(addr);
+}
+
+void HotRestart::serve(vector<int> fds, HandoffCallBack on_handoff) {
+    loop->call_soon([this, fds = move(fds), on_handoff = move(on_handoff)]() mutable {
+        this->fds = move(fds);
+        this->on_handoff = move(on_handoff);
+        // the predecessor, if any, has handed over already
+        ::unlink(path.c_str());
+        auto addr = unix_addr(path);
+        if (::bind(listener.fd(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+            || listener.listen() < 0) {
+            LOG(ERROR) << "Serving listener handoff on " << path 
+                       << " failed, errno " << errno;
+            return;
+        }
+        channel.enable(Channel::READ);
+    });
+}
+
+void HotRestart::handle_accept() {
+    while (true) {
+        Socket conn = listener.accept();
+        if (conn.fd() < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+        HandoffHeader header {HANDOFF_MAGIC, static_cast<uint32_t>(fds.size())};
+        // a few bytes on a fresh unix socket, never partial
+        if (conn.send_fds(fds.data(), fds.size(), &header, sizeof(header))
+            != static_cast<ssize_t>(sizeof(header))) {
+            LOG(ERROR) << "Handing off listeners failed, errno " << errno;
+            continue;
+        }
+        // only one successor takes over
+        close();
+        if (on_handoff)
+            on_handoff();
+        return;
+    }
+}
+
+void HotRestart::close() {
+    if (listener.fd() < 0)
+        return;
+    channel.destroy();
+    // the successor has bound the path already if it serves itself
+    listener.close();
+}
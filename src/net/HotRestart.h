@@ -0,0 +1,53 @@
+#pragma once
+#include "Socket.h"
+#include "eventloop/Channel.h"
+#include "eventloop/ThreadingEventLoop.h"
+#include "../utils/Common.h"
+#include <string>
+#include <vector>
+#include <functional>
+
+using namespace std;
+using namespace chrono;
+
+
+// Listening sockets survive a restart by being passed from the running
+// process to its successor over a unix domain socket(SCM_RIGHTS). The
+// successor asks for them on startup, so the accept backlog and SYNs in
+// flight are never lost; the old process then stops accepting and drains
+// its connections, see TcpServer::drain().
+class HotRestart : public NoCopyble {
+public:
+    using HandoffCallBack = function<void()>;
+    static const size_t MAX_FDS = 64;
+
+protected:
+    EventLoop* loop;
+    string path;
+    Socket listener;
+    Channel channel;
+    vector<int> fds;
+    HandoffCallBack on_handoff;
+
+    void handle_accept();
+
+public:
+    static Channel::Protocol channel_protocol;
+
+    HotRestart(EventLoop* loop, const string & path);
+    ~HotRestart();
+
+    // successor side, blocks for at most timeout. Returns the listening
+    // sockets of the running process, none if there is nothing to take over.
+    static vector<Socket> inherit(const string & path,
+                                  const milliseconds & timeout = 5s);
+    // moves the socket listening on addr out of inherited, or creates a
+    // fresh one(cold start).
+    static Socket take_listener(vector<Socket> & inherited, const InetAddr & addr);
+
+    // running side, hands fds to the next process that connects to path.
+    // on_handoff runs within the loop once they have been sent, the fds are
+    // still open and owned by their servers.
+    void serve(vector<int> fds, HandoffCallBack on_handoff);
+    void close();
+};
@@ -0,0 +1,71 @@
+#include "MetricsServer.h"
+#include <string_view>
+
+using namespace std;
+
+
+MetricsServer::MetricsServer(ThreadingEventLoop & pool, const InetAddr & addr,
+                             Collector collector)
+    : pool(pool),
+      collector(move(collector)),
+      protocol{
+          {},
+          [this](Transport & conn) { handle_request(conn); }
+      },
+      server(addr, [&pool](bool) { return pool.get_loop(true); }, 10s, &protocol) {}
+
+bool MetricsServer::activate() {
+    return server.activate();
+}
+
+void MetricsServer::handle_request(Transport & conn) {
+    auto & rbuffer = conn.rbuffer;
+    string request;
+    for (ssize_t i = 0; i < rbuffer.size(); ++i)
+        request += rbuffer[i];
+    if (request.find("\r\n\r\n") == string::npos)
+        return;
+    // answered once, even if more arrives while /trace is being built
+    rbuffer.consume(rbuffer.size());
+
+    string_view path(request);
+    path = path.substr(path.find(' ') + 1);
+    path = path.substr(0, path.find(' '));
+
+    string status = "200 OK", body;
+    string content_type = "text/plain; version=0.0.4";
+    if (path == "/metrics") {
+        auto snapshot = pool.metrics();
+        if (collector)
+            collector(snapshot);
+        body = snapshot.to_prometheus();
+    }
+    else if (path == "/trace/start") {
+        pool.start_tracing();
+    }
+    else if (path == "/trace/stop") {
+        pool.stop_tracing();
+    }
+    else if (path == "/trace") {
+        pool.dump_trace([conn = conn.shared_from_this()](string json) {
+            if (!conn->closed())
+                respond(*conn, "200 OK", "application/json", json);
+        });
+        return;
+    }
+    else {
+        status = "404 Not Found";
+    }
+    respond(conn, status, content_type, body);
+}
+
+void MetricsServer::respond(Transport & conn, const string & status,
+                            const string & content_type, const string & body) {
+    string response = "HTTP/1.1 " + status + "\r\n"
+                      "Content-Type: " + content_type + "\r\n"
+                      "Content-Length: " + to_string(body.size()) + "\r\n"
+                      "Connection: close\r\n\r\n" + body;
+    // sent within the loop, the data is copied before returning
+    conn.send(response.data(), response.size());
+    conn.close();
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "Server.h"
+#include "../utils/Metrics.h"
+#include "../utils/Common.h"
+#include <functional>
+
+using namespace std;
+
+
+// Serves the merged metrics of a ThreadingEventLoop in prometheus text
+// format over http, meant for a local admin port. Scrapes are handled
+// within the main loop.
+// GET /trace/start, /trace/stop and /trace(chrome trace_event JSON) control
+// the event tracer when it is compiled in, the JSON is built in pieces across
+// iterations of the main loop.
+class MetricsServer : public NoCopyble {
+public:
+    // extra metrics appended to every scrape, e.g. per server ones
+    using Collector = function<void(MetricsSnapshot &)>;
+
+protected:
+    ThreadingEventLoop & pool;
+    Collector collector;
+    TcpTransport::Protocol protocol;
+    TcpServer server;
+
+    void handle_request(Transport & conn);
+    static void respond(Transport & conn, const string & status,
+                        const string & content_type, const string & body);
+
+public:
+    MetricsServer(ThreadingEventLoop & pool,
+                  const InetAddr & addr = {"127.0.0.1", 9100},
+                  Collector collector = {});
+
+    bool activate();
+    bool operator()() {
+        return activate();
+    }
+    const Socket & get_socket() const {
+        return server.get_socket();
+    }
+};
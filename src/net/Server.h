@@ -1,32 +1,25 @@
 #pragma once
 #include "Transport.h"
+#include "UnixTransport.h"
+#include "TlsTransport.h"
 #include "eventloop/ThreadingEventLoop.h"
 #include "../utils/Common.h"
+#include "../utils/Metrics.h"
+#include "../utils/Pool.h"
 #include <memory>
 #include <functional>
 #include <iostream>
-#include "TimingWheel.h"
+#include <unordered_set>
 #include <unordered_map>
+#include <algorithm>
+#include <tuple>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace chrono;
 
 class TcpServer : public NoCopyble {
-protected:
-    class TimeOutEntry {
-    private:
-        weak_ptr<Transport> conn;
-    public:
-        TimeOutEntry() {}
-        explicit TimeOutEntry(const weak_ptr<Transport> & conn) : conn(conn) {}
-        ~TimeOutEntry() {
-            if (!conn.expired()) {
-                auto sp = conn.lock();
-                sp->force_close();
-            }
-        }
-    };
-
 protected:
     using LoopFetcher = function<EventLoop*(bool)>;
     LoopFetcher get_loop;
@@ -37,9 +30,233 @@ protected:
     TcpTransport::Protocol server_protocol;
     shared_ptr<Transport> server;
     chrono::seconds client_timeout;
-    unordered_map<shared_ptr<Transport>, weak_ptr<TimeOutEntry>> connections;
-    TimingWheel timing_wheel;
+    // accepted connections are UnixTransports
+    bool unix_domain;
+    // set on the listening socket, see SocketOptions
+    SocketOptions options;
+#if NETYO_TLS
+    shared_ptr<TlsContext> tls;
+#endif
+    // idle timeouts are handled by each connection's own loop
+    // nodes are recycled by the server loop
+    unordered_set<shared_ptr<Transport>, hash<shared_ptr<Transport>>,
+                  equal_to<shared_ptr<Transport>>,
+                  PoolAllocator<shared_ptr<Transport>>> connections;
     vector<shared_ptr<Transport>> v;
+    // connections not lost yet, they are erased from the set lazily
+    atomic<size_t> num_active {0};
+    // 0 for no limit, accepting pauses at the limit until a connection is lost
+    size_t max_connections = 0;
+    // given up to accept and close one connection while out of fds
+    int spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    // accepting pauses for a while after failures, doubled up to the max
+    static constexpr milliseconds MIN_ACCEPT_BACKOFF = 10ms, MAX_ACCEPT_BACKOFF = 1s;
+    milliseconds accept_backoff = 0ms;
+    bool accept_paused = false;
+    TimerId accept_timer = 0;
+    // lost connections are erased in batches by one timer, one to two
+    // intervals after they were lost
+    static constexpr seconds RELEASE_INTERVAL = 1s;
+    vector<shared_ptr<Transport>> lost, releasing;
+    TimerId release_timer = 0;
+
+    // delay 0 pauses until a connection is lost
+    void pause_accepting(const milliseconds & delay) {
+        LoopMetrics::local().accepts_deferred.inc();
+        accept_paused = true;
+        server->pause_reading();
+        if (delay > 0ms) {
+            accept_timer = server_loop->call_later([this]() {
+                accept_timer = 0;
+                resume_accepting();
+            }, delay);
+        }
+    }
+
+    void resume_accepting() {
+        if (accept_paused && !accept_timer
+            && (!max_connections || num_active < max_connections)) {
+            accept_paused = false;
+            // edge triggered, registering again reports the pending ones
+            server->resume_reading();
+        }
+    }
+
+    void backoff_accepting() {
+        accept_backoff = clamp(accept_backoff * 2, MIN_ACCEPT_BACKOFF, MAX_ACCEPT_BACKOFF);
+        pause_accepting(accept_backoff);
+    }
+
+    // until the backlog is empty, or accepting pauses
+    void accept_pending() {
+        auto & listening = server->get_socket();
+        for (;;) {
+            if (max_connections && num_active >= max_connections) {
+                pause_accepting(0ms);
+                return;
+            }
+            auto socket = listening.accept();
+            if (socket.fd() < 0) {
+                int error = errno;
+                if (error == EAGAIN || error == EWOULDBLOCK) {
+                    accept_backoff = 0ms;
+                    return;
+                }
+                // the connection went away or failed, the next one may be fine
+                if (error == ECONNABORTED || error == EINTR || error == EPROTO
+                    || error == EPERM)
+                    continue;
+                if ((error == EMFILE || error == ENFILE) && spare_fd >= 0) {
+                    // the peer sees the connection closed rather than waiting
+                    // in the backlog
+                    ::close(spare_fd);
+                    if (listening.accept().fd() >= 0)
+                        LoopMetrics::local().accepts_dropped.inc();
+                    spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+                }
+                // out of fds or memory, the rest waits in the backlog
+                backoff_accepting();
+                return;
+            }
+            if (auto budget = server_loop->memory_budget();
+                budget && !budget->admit(server_loop->index())) {
+                // out of buffer memory, a zero linger makes the close send
+                // a reset and keeps no state for the peer
+                struct linger reset{1, 0};
+                ::setsockopt(socket.fd(), SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+                LoopMetrics::local().accepts_dropped.inc();
+                continue;
+            }
+            options.apply_accepted(socket);
+            auto loop = get_loop(false);
+            auto pclient = make_transport(loop, move(socket));
+            pclient->set_latency_stats(latency_of(loop));
+            connections.insert(pclient);
+            num_active++;
+            pclient->activate();
+        }
+    }
+
+    void release_lost() {
+        for (auto & conn : releasing)
+            connections.erase(conn);
+        releasing.clear();
+        swap(lost, releasing);
+    }
+    // object and control block in one block recycled by the server loop
+    shared_ptr<TcpTransport> make_transport(EventLoop* loop, Socket && socket) {
+#if NETYO_TLS
+        if (tls) {
+            return allocate_shared<TlsTransport>(
+                PoolAllocator<TlsTransport>(),
+                loop, move(socket), client_timeout,
+                client_protocol, channel_protocol, tls
+            );
+        }
+#endif
+        if (unix_domain) {
+            return allocate_shared<UnixTransport>(
+                PoolAllocator<UnixTransport>(),
+                loop, move(socket), client_timeout,
+                client_protocol, channel_protocol
+            );
+        }
+        return allocate_shared<TcpTransport>(
+            PoolAllocator<TcpTransport>(),
+            loop, move(socket), client_timeout,
+            client_protocol, channel_protocol
+        );
+    }
+
+    TimerId rebalance_timer = 0;
+
+    // moves the hottest connections of the busiest loop to the least busy
+    // one, by bytes received since the last round
+    void rebalance(const vector<EventLoop*> & loops, double imbalance, size_t max_moves) {
+        unordered_map<EventLoop*, uint64_t> heat;
+        for (auto loop : loops)
+            heat[loop] = 0;
+        vector<tuple<uint64_t, EventLoop*, shared_ptr<TcpTransport>>> deltas;
+        for (auto & conn : connections) {
+            // lost ones wait for release_lost()
+            if (conn->closed())
+                continue;
+            auto tcp = static_pointer_cast<TcpTransport>(conn);
+            uint64_t delta = tcp->received_since_mark();
+            auto loop = conn->get_event_loop();
+            if (delta && heat.count(loop)) {
+                heat[loop] += delta;
+                deltas.emplace_back(delta, loop, move(tcp));
+            }
+        }
+        EventLoop *hot = nullptr, *cold = nullptr;
+        uint64_t total = 0;
+        for (auto & [loop, bytes] : heat) {
+            total += bytes;
+            if (!hot || bytes > heat[hot])
+                hot = loop;
+            if (!cold || bytes < heat[cold])
+                cold = loop;
+        }
+        if (!hot || hot == cold || heat[hot] <= imbalance * total / heat.size())
+            return;
+        sort(deltas.begin(), deltas.end(),
+             [](auto & a, auto & b) { return get<0>(a) > get<0>(b); });
+        // about half the gap, moving the whole gap or more just swaps the roles
+        uint64_t gap = heat[hot] - heat[cold], moved = 0;
+        auto stats = latency_of(cold);
+        size_t moves = 0;
+        for (auto & [delta, loop, conn] : deltas) {
+            if (moves == max_moves || 2 * moved >= gap)
+                break;
+            if (loop != hot || moved + delta >= gap)
+                continue;
+            moved += delta;
+            moves++;
+            // busy connections stay, migrate() only moves idle ones
+            conn->run_in_loop([conn = conn, cold, stats]() {
+                conn->migrate(cold, stats);
+            });
+        }
+    }
+
+    // per loop index, only created by the server loop and read from anywhere
+    static const size_t MAX_LOOPS = 64;
+    atomic<ConnectionLatency*> latency[MAX_LOOPS] {};
+
+    ConnectionLatency* latency_of(EventLoop* loop) {
+        auto & slot = latency[loop->index() % MAX_LOOPS];
+        if (!slot.load(memory_order_relaxed))
+            slot.store(new ConnectionLatency, memory_order_release);
+        return slot.load(memory_order_relaxed);
+    }
+
+    void wait_drained(const Time & deadline, const function<void()> & done) {
+        if (num_active && EventLoop::precise_now() < deadline) {
+            server_loop->call_later([=, this]() { 
+                wait_drained(deadline, done);
+            }, 50ms);
+            return;
+        }
+        auto remaining = make_shared<atomic<size_t>>(connections.size() + 1);
+        auto finish = [remaining, done, server_loop = server_loop]() {
+            // their connection_lost_cbs have queued to the server loop before
+            if (remaining->fetch_sub(1, memory_order_acq_rel) == 1)
+                server_loop->call_soon(done);
+        };
+        for (auto & conn : connections) {
+            conn->run_in_loop([conn, finish]() {
+                // flushes what has been sent already at the end of this
+                // iteration, what the peer does not take by the next is dropped
+                conn->close();
+                conn->get_event_loop()->post([conn, finish]() {
+                    conn->force_close();
+                    finish();
+                });
+            });
+        }
+        finish();
+    }
 
 public:
     TcpServer(
@@ -48,89 +265,67 @@ public:
         chrono::seconds timeout = 0s,
         TcpTransport::Protocol* protocol = &TcpTransport::default_protocol,
         Channel::Protocol* channel_protocol = &TcpTransport::default_channel_protocol)
+    : TcpServer(Socket::server_socket(addr), get_loop, timeout, 
+                protocol, channel_protocol) {}
+
+    // from a bound(or already listening) socket, e.g. one inherited from
+    // the previous process by HotRestart.
+    TcpServer(
+        Socket && listening,
+        const LoopFetcher & get_loop, 
+        chrono::seconds timeout = 0s,
+        TcpTransport::Protocol* protocol = &TcpTransport::default_protocol,
+        Channel::Protocol* channel_protocol = &TcpTransport::default_channel_protocol)
     : get_loop(get_loop),
       server_loop(get_loop(true)),
       client_protocol(protocol),
       channel_protocol(channel_protocol),
       client_timeout(timeout),
-      timing_wheel(server_loop, duration_cast<seconds>(10min).count()),
       server(new TcpServerAcceptor(server_loop, 
-                    Socket::server_socket(addr), 0s, 
-                    &server_protocol, channel_protocol)) {
+                    move(listening), 0s, 
+                    &server_protocol, channel_protocol)),
+      unix_domain(server->get_socket().local_addr().is_unix()) {
 
         server_protocol = {
             {},
-            [this](auto pconn) {
-                int sockfd = 0;
-                // loop if used for handling EPOLLLET mode
-                // TODO(zhongquan789@gmail.com) Move TimingWheel to each worker
-                do {
-                    auto socket = pconn->get_socket().accept();
-                    sockfd = socket.fd();
-                    if (sockfd < 0) {
-                        socket.close();
-                    }
-                    else {
-                        auto pclient = shared_ptr<Transport>(new TcpTransport{
-                            this->get_loop(false), move(socket), client_timeout,
-                            this->client_protocol, this->channel_protocol
-                        });
-                        connections.emplace(pclient, weak_ptr<TimeOutEntry>());
-                        pclient->activate();
-                    }
-                } while (sockfd > 0);
-            }
+            [this](Transport &) { accept_pending(); }
         };
-        if (!client_protocol->reset_timeout_cb) {
-            client_protocol->reset_timeout_cb = 
-                [this](auto pconn, const auto & timeout) {
-                // must call call_sonn, otherwise it's not synchronized.
-                server_loop->call_soon([=]() {
-                    if (!connections.count(pconn)) {
-                        // error
-                    }
-                    else {
-                        if (connections[pconn].expired()) {
-                            auto entry = make_shared<TimeOutEntry>(pconn);
-                            connections[pconn] = entry;
-                            timing_wheel.insert(timeout.count(), entry);
-                        }
-                        else {
-                            timing_wheel.insert(
-                                timeout.count(), 
-                                connections[pconn].lock()
-                            );
-                        }
-                    }
-                });
-            };
-        }
         
         auto conn_lost_cb = client_protocol->connection_lost_cb;
-        // must use call_later, as some contoller of channel mightbe predead.
+        // must be released later, as some contoller of channel mightbe predead.
         // TODO: Find another way to handle Segmentaion Fault caused by this
         if (conn_lost_cb) {
             client_protocol->connection_lost_cb = 
             [this, conn_lost_cb](auto pconn) {
                 conn_lost_cb(pconn);
-                server_loop->call_later([pconn, this]() { 
-                    connections.erase(pconn); 
-                }, 2s);
+                num_active--;
+                server_loop->call_soon([pconn, this]() { 
+                    lost.push_back(pconn);
+                    resume_accepting();
+                });
             };
         }
         else {
             client_protocol->connection_lost_cb = 
             [this](auto pconn) {
-                server_loop->call_later([pconn, this] () {
-                    connections.erase(pconn);
-                }, 2s);
+                num_active--;
+                server_loop->call_soon([pconn, this] () {
+                    lost.push_back(pconn);
+                    resume_accepting();
+                });
             };
         }
+        release_timer = server_loop->call_every([this]() { release_lost(); }, 
+                                                RELEASE_INTERVAL);
     }
     ~TcpServer() {
-        for (auto [pconn, wptr] : connections) {
-            wptr.reset();
-        }
+        server_loop->cancel(release_timer);
+        server_loop->cancel(rebalance_timer);
+        server_loop->cancel(accept_timer);
+        if (spare_fd >= 0)
+            ::close(spare_fd);
+        for (auto & stats : latency)
+            delete stats.load();
     }
 
     bool operator()() {
@@ -139,17 +334,93 @@ public:
 
     bool activate() {
         server_loop->call_soon([this]() {
-            server->get_socket().listen();
+            auto & listening = server->get_socket();
+            options.apply_listener(listening);
+            listening.listen(options.backlog);
             server->activate();
         });
-        server_loop->call_every([&]() {
-            cout << "Server states: sockerr:" << server->get_socket().getsockerr() << " "
-                 << "num connections: " << connections.size() << endl;
-        }, 5s);
         return true;
     }
 
     const Socket & get_socket() const {
         return server->get_socket();
     }
+
+    // before activate()
+    void set_socket_options(const SocketOptions & options) {
+        this->options = options;
+    }
+
+    // before activate(), 0 for no limit. Pending connections beyond it wait
+    // in the backlog.
+    void set_max_connections(size_t max) {
+        max_connections = max;
+    }
+
+#if NETYO_TLS
+    // accepted connections are TlsTransports, before activate()
+    void set_tls(shared_ptr<TlsContext> context) {
+        tls = move(context);
+    }
+#endif
+
+    size_t num_connections() const {
+        return num_active;
+    }
+
+    // connection count and the latency histograms of all loops, merged:
+    // netyo_server_handler_time_ns, time spent in data_received_cb;
+    // netyo_server_first_write_latency_ns, from read readiness to the first
+    // byte of the response written.
+    void collect(MetricsSnapshot & snapshot) const {
+        Gauge connections;
+        connections.set(num_active);
+        snapshot.add("netyo_server_connections", "Open connections", connections);
+        LatencyHistogram::Snapshot handler_time, first_write_latency;
+        for (auto & slot : latency) {
+            if (auto stats = slot.load(memory_order_acquire)) {
+                handler_time.merge(stats->handler_time);
+                first_write_latency.merge(stats->first_write_latency);
+            }
+        }
+        snapshot.add("netyo_server_handler_time_ns",
+                     "Time spent in data_received_cb", handler_time);
+        snapshot.add("netyo_server_first_write_latency_ns",
+                     "Read readiness to the first response write", first_write_latency);
+    }
+
+    // every interval the connections of the loop receiving over imbalance
+    // times the average are moved to the least busy one, at most max_moves
+    // per round. Connections are moved while idle, within the same iteration,
+    // their latency histograms become the target's.
+    void rebalance_every(vector<EventLoop*> loops,
+                         const milliseconds & interval = 1s,
+                         double imbalance = 1.5, size_t max_moves = 4) {
+        server_loop->call_soon([=, this]() {
+            server_loop->cancel(rebalance_timer);
+            rebalance_timer = server_loop->call_every([=, this]() {
+                rebalance(loops, imbalance, max_moves);
+            }, interval);
+        });
+    }
+
+    // the listening socket stays open and bound, pending connections are
+    // left to other processes listening on it, e.g. after a HotRestart handoff.
+    void stop_accepting() {
+        server_loop->call_soon([this]() {
+            server_loop->cancel(rebalance_timer);
+            server_loop->cancel(accept_timer);
+            server->get_channel().destroy();
+        });
+    }
+
+    // stop accepting and wait for the connections to finish. The ones still
+    // open at the deadline are closed, done runs within the server loop once
+    // all of them are, the server may be destroyed from then on.
+    void drain(const milliseconds & timeout, function<void()> done) {
+        stop_accepting();
+        server_loop->call_soon([this, timeout, done = move(done)]() {
+            wait_drained(EventLoop::precise_now() + timeout, done);
+        });
+    }
 };
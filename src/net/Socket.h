@@ -9,18 +9,25 @@
 
 #pragma once
 #include "../utils/Common.h"
+#include "../utils/Metrics.h"
+#include "../utils/Logging.h"
+#include "../utils/Trace.h"
 #include "string"
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <strings.h>
 #include <netinet/tcp.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <string.h>
+#include <stddef.h>
 #include <iostream>
 #include <string>
+#include <vector>
 
 
 
@@ -47,17 +54,24 @@
 
 
 
+// An ipv4/ipv6 address or a unix domain socket path, see unix_path().
 class InetAddr {
 private:
     union {
         sockaddr_in addr;
         sockaddr_in6 addr6;
+        sockaddr_un addr_un;
     };
 public:
-    InetAddr() : addr6{}  {}
-    InetAddr(const sockaddr_in & addr) : addr(addr) {}
-    InetAddr(const sockaddr_in6 & addr) : addr6(addr) {}
-    InetAddr(const string & ipaddr, uint16_t port) : addr6{} {
+    InetAddr() : addr_un{}  {}
+    InetAddr(const sockaddr_in & addr) : addr_un{} { this->addr = addr; }
+    InetAddr(const sockaddr_in6 & addr) : addr_un{} { addr6 = addr; }
+    InetAddr(const sockaddr_un & addr) : addr_un(addr) {}
+    // e.g. filled by getsockname()
+    InetAddr(const struct sockaddr * sa, socklen_t len) : addr_un{} {
+        ::memcpy(&addr_un, sa, min<size_t>(len, sizeof(addr_un)));
+    }
+    InetAddr(const string & ipaddr, uint16_t port) : addr_un{} {
         if (::inet_pton(AF_INET, ipaddr.c_str(), &addr.sin_addr) > 0) {
             addr.sin_family = AF_INET;
             addr.sin_port = htons(port);
@@ -67,19 +81,37 @@ public:
             addr6.sin6_port = htons(port);
         }
         else {
-            // error
+            LOG(ERROR) << "Invalid ip address " << ipaddr;
         }
     }
-    InetAddr(const InetAddr & other) : addr6(other.addr6) {}
+    InetAddr(const InetAddr & other) : addr_un(other.addr_un) {}
     InetAddr& operator=(const InetAddr & other) {
-        addr6 = other.addr6;
+        addr_un = other.addr_un;
         return *this;
     }
+
+    // a leading '@' names an abstract socket, which leaves no file behind
+    static InetAddr unix_path(const string & path) {
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            LOG(ERROR) << "Unix socket path too long " << path;
+        ::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (path.size() && path[0] == '@')
+            addr.sun_path[0] = '\0';
+        return addr;
+    }
     const struct sockaddr * sockaddr() const {
         return static_cast<const struct sockaddr*>((void *)&addr6);
     }
 
     socklen_t sockaddrlen() const {
+        if (is_unix()) {
+            // abstract names end at the first nul after the leading one
+            const char * path = addr_un.sun_path;
+            size_t len = path[0] ? ::strlen(path) + 1 : 1 + ::strlen(path + 1);
+            return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + len);
+        }
         return is_ipv4() ? 
                     static_cast<socklen_t>(sizeof(sockaddr_in)) 
                   : static_cast<socklen_t>(sizeof(sockaddr_in6));
@@ -88,12 +120,40 @@ public:
     bool is_ipv4() const {
         return addr.sin_family == AF_INET;
     }
+    bool is_unix() const {
+        return addr.sin_family == AF_UNIX;
+    }
+
+    bool operator==(const InetAddr & other) const {
+        if (family() != other.family())
+            return false;
+        if (is_unix())
+            return path() == other.path();
+        if (is_ipv4())
+            return addr.sin_port == other.addr.sin_port
+                && addr.sin_addr.s_addr == other.addr.sin_addr.s_addr;
+        return addr6.sin6_port == other.addr6.sin6_port
+            && ::memcmp(&addr6.sin6_addr, &other.addr6.sin6_addr, sizeof(in6_addr)) == 0;
+    }
+    bool operator!=(const InetAddr & other) const {
+        return !(*this == other);
+    }
 
     operator string() const {
+        if (is_unix())
+            return "unix:" + path();
         return ip() + ":" + to_string(port());
     }
 
+    // unix domain sockets only, abstract names with their leading '@'
+    string path() const {
+        const char * path = addr_un.sun_path;
+        return path[0] ? string(path) : "@" + string(path + 1);
+    }
+
     string ip() const {
+        if (is_unix())
+            return path();
         char buf[64];
         if (is_ipv4()) {
             ::inet_ntop(AF_INET, &addr.sin_addr, buf, 
@@ -107,7 +167,9 @@ public:
     }
 
     uint16_t port() const {
-        return is_ipv4() ? addr.sin_port : addr6.sin6_port;
+        if (is_unix())
+            return 0;
+        return ntohs(is_ipv4() ? addr.sin_port : addr6.sin6_port);
     }
 
     sa_family_t family() const {
@@ -130,14 +192,16 @@ public:
     Socket() {}
     Socket(int family, int type, int proto)
         : sock_fd(::socket(family, type, proto)) {
+        // e.g. EMFILE, left to the caller through fd() < 0 and errno
         if (sock_fd < 0) {
-            // error
-            exit(1);
+            int err = errno;
+            LOG(ERROR) << "Creating socket failed, errno " << err;
+            errno = err;
         }
     }
     Socket(int sock_fd) : sock_fd(sock_fd), localaddr(getsockname()) {
         if (sock_fd < 0) {
-            // error
+            LOG(ERROR) << "Invalid socket fd " << sock_fd;
         }
     }
     Socket(const Socket & other) = delete;
@@ -145,25 +209,69 @@ public:
         swap(sock_fd, other.sock_fd);
         swap(localaddr, other.localaddr);
     }
+    Socket& operator=(Socket && other) {
+        swap(sock_fd, other.sock_fd);
+        swap(localaddr, other.localaddr);
+        return *this;
+    }
     ~Socket() {
         close();
     }
-    static Socket server_socket(const InetAddr & localaddr) {
-        Socket sock = Socket(DEFAULT_FAMILY, DEFAULT_TYPE, DEFAULT_PROTO);
+    // type is SOCK_STREAM or, for unix domain sockets, SOCK_SEQPACKET
+    static Socket client_socket(const InetAddr & peeraddr, int type = SOCK_STREAM) {
+        return Socket(peeraddr.family(), type | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      peeraddr.is_unix() ? 0 : DEFAULT_PROTO);
+    }
+
+    // a stale socket file left at a unix path is replaced
+    static Socket server_socket(const InetAddr & localaddr, int type = SOCK_STREAM) {
+        if (localaddr.is_unix()) {
+            Socket sock = Socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (sock.fd() < 0)
+                return sock;
+            string path = localaddr.path();
+            if (path[0] != '@')
+                ::unlink(path.c_str());
+            sock.bind(localaddr);
+            return sock;
+        }
+        Socket sock = Socket(localaddr.family(), type | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                             DEFAULT_PROTO);
+        if (sock.fd() < 0)
+            return sock;
         sock.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1);
     #ifdef SO_REUSEPORT
         sock.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
     #endif
-        if (sock.bind(localaddr) < 0) {
-            // erro
-            // ERROR << "Binding " << string(localaddr) << " Failed! \n";
-        }
+        // bind() logs failures
+        sock.bind(localaddr);
+        return sock;
+    }
+
+    // bound to localaddr(port 0 picks one, e.g. for clients), several
+    // sockets may share the port to spread datagrams over loops.
+    static Socket udp_socket(const InetAddr & localaddr) {
+        Socket sock = Socket(localaddr.family(), 
+                             SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+        if (sock.fd() < 0)
+            return sock;
+    #ifdef SO_REUSEPORT
+        sock.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+    #endif
+        sock.bind(localaddr);
         return sock;
     }
 
-    void setsockopt(int level, int optname, int value) {
-        ::setsockopt(sock_fd, level, optname, &value, 
-                     static_cast<socklen_t>(sizeof(value)));
+    int setsockopt(int level, int optname, int value) {
+        return ::setsockopt(sock_fd, level, optname, &value, 
+                            static_cast<socklen_t>(sizeof(value)));
+    }
+
+    int getsockopt(int level, int optname) const {
+        int value = 0;
+        socklen_t len = static_cast<socklen_t>(sizeof(value));
+        ::getsockopt(sock_fd, level, optname, &value, &len);
+        return value;
     }
 
     int bind(const InetAddr & localaddr) {
@@ -171,7 +279,7 @@ public:
                          localaddr.sockaddr(), localaddr.sockaddrlen());
 
         if (res < 0) {
-            // ERROR << "Binding " << string(localaddr) << " Failed! \n";
+            LOG(ERROR) << "Binding " << string(localaddr) << " failed, errno " << errno;
         }
         else {
             this->localaddr = getsockname();
@@ -179,23 +287,27 @@ public:
         return res;
     }
 
-    int connect(const InetAddr & localaddr) {
+    // non-blocking sockets return -1 with errno EINPROGRESS, wait for
+    // writable and check getsockerr() then.
+    int connect(const InetAddr & peeraddr) {
         int res = ::connect(sock_fd, 
-                            localaddr.sockaddr(), localaddr.sockaddrlen());
-        if (res < 0) {
-            // error
+                            peeraddr.sockaddr(), peeraddr.sockaddrlen());
+        int saved_errno = errno;
+        if (res < 0 && errno != EINPROGRESS) {
+            LOG(WARN) << "Connecting " << string(peeraddr) << " failed, errno " << saved_errno;
         }
         else {
             this->localaddr = getsockname();
         }
+        errno = saved_errno;
         return res;
     }
 
-    int listen() {
-        int res = ::listen(sock_fd, SOMAXCONN);
+    // again on a listening socket updates the backlog
+    int listen(int backlog = SOMAXCONN) {
+        int res = ::listen(sock_fd, backlog);
         if (res < 0) {
-            // error
-            // ERROR << "Listening " << string(localaddr) << " Failed.\n";
+            LOG(ERROR) << "Listening " << string(localaddr) << " failed, errno " << errno;
         }
         return res;
     }
@@ -208,23 +320,37 @@ public:
                                &size,
                                SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (connfd < 0) {
-            // WARNING << "Accept failed with error code " << connfd << "\n";
+            // running out of pending connections is the normal way out
+            if (errno != EAGAIN) {
+                int saved_errno = errno;
+                LOG(WARN) << "Accept failed, errno " << saved_errno;
+                errno = saved_errno;
+            }
+            // keep errno for the caller
+            return Socket();
         }
+        LoopMetrics::local().accepts.inc();
+        TRACE(instant(TraceType::ACCEPT, connfd));
         return connfd;
     }
 
     int shutdown(int op = SHUT_WR) {
         int res = ::shutdown(sock_fd, op);
         if (res < 0) {
-            // error
+            // ENOTCONN after the peer reset the connection
+            LOG(DEBUG) << "Shutdown fd " << sock_fd << " failed, errno " << errno;
         }
         return res;
     }
 
     int close() {
         int res = 0;
-        if (sock_fd > 0) 
-            ::close(sock_fd);
+        if (sock_fd > 0) {
+            TRACE(instant(TraceType::CLOSE, sock_fd));
+            res = ::close(sock_fd);
+            sock_fd = -1;
+            LoopMetrics::local().closes.inc();
+        }
         return res;
     }
 
@@ -237,26 +363,31 @@ public:
             return optval;
     }
 
-    sockaddr_in6 getsockname() const {
-        sockaddr_in6 addr6{};
-        socklen_t addrlen = static_cast<socklen_t>(sizeof(addr6));
+    InetAddr getsockname() const {
+        sockaddr_storage storage{};
+        socklen_t addrlen = static_cast<socklen_t>(sizeof(storage));
         if (::getsockname(sock_fd,
-                          static_cast<sockaddr*>((void*)&addr6),
+                          static_cast<sockaddr*>((void*)&storage),
                           &addrlen) < 0) {
-            // error
+            LOG(ERROR) << "getsockname of fd " << sock_fd << " failed, errno " << errno;
         }
-        return addr6;
+        return {static_cast<sockaddr*>((void*)&storage), addrlen};
     }
 
-    sockaddr_in6 getpeername() const {
-        sockaddr_in6 addr6{};
-        socklen_t addrlen = static_cast<socklen_t>(sizeof(addr6));
+    InetAddr getpeername() const {
+        sockaddr_storage storage{};
+        socklen_t addrlen = static_cast<socklen_t>(sizeof(storage));
         if (::getpeername(sock_fd,
-                          static_cast<sockaddr*>((void*)&addr6),
+                          static_cast<sockaddr*>((void*)&storage),
                           &addrlen) < 0) {
-            // error
+            // e.g. listening or not yet connected sockets
+            LOG(DEBUG) << "getpeername of fd " << sock_fd << " failed, errno " << errno;
         }
-        return addr6;
+        return {static_cast<sockaddr*>((void*)&storage), addrlen};
+    }
+
+    const InetAddr & local_addr() const {
+        return localaddr;
     }
 
     operator string() const {
@@ -273,6 +404,54 @@ public:
     ssize_t send(const void* data, size_t len) {
         return ::write(sock_fd, data, len);
     }
+
+    // passes num fds(SCM_RIGHTS) over a unix domain socket together with a
+    // non-empty payload, returns the sendmsg result.
+    ssize_t send_fds(const int * fds, size_t num, const void * data, size_t len) {
+        iovec iov {const_cast<void*>(data), len};
+        msghdr msg {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * num));
+        if (num) {
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num);
+            ::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num);
+        }
+        return ::sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+    }
+
+    // num is the capacity of fds and becomes the number of fds received,
+    // which are close-on-exec. Returns the recvmsg result.
+    ssize_t recv_fds(int * fds, size_t & num, void * data, size_t len) {
+        iovec iov {data, len};
+        msghdr msg {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * (num ? num : 1)));
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        ssize_t res = ::recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC);
+        size_t received = 0;
+        if (res >= 0) {
+            for (cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; 
+                 cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                    continue;
+                size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                if (n > num - received)
+                    n = num - received;
+                ::memcpy(fds + received, CMSG_DATA(cmsg), sizeof(int) * n);
+                received += n;
+            }
+        }
+        num = received;
+        return res;
+    }
 };
 
 
@@ -280,4 +459,100 @@ template <typename OStream>
 OStream & operator<<(OStream && ostream, const Socket & sock) {
     ostream << string(sock);
     return ostream;
-}
\ No newline at end of file
+}
+
+
+// Socket tuning of a TcpServer or a TcpClient, 0(or -1 for tos) keeps the
+// kernel's default. Servers set everything on the listening socket, accepted
+// sockets inherit it from there and only quickack is set per accept.
+// Options of another family are skipped, e.g. tcp ones for unix domain
+// sockets.
+struct SocketOptions {
+    int backlog = SOMAXCONN;
+    bool nodelay = true, keepalive = true;
+    // bytes, set before listen()/connect() to take part in window scaling
+    int rcvbuf = 0, sndbuf = 0;
+    // listeners only, seconds to wait for the first data before accepting
+    int defer_accept = 0;
+    // the queue length of pending fast open requests on listeners, clients
+    // send their first data along with the SYN(TCP_FASTOPEN_CONNECT) if set
+    int fastopen = 0;
+    bool quickack = false;
+    // milliseconds unacknowledged data may stay in flight before a reset
+    int user_timeout = 0;
+    // seconds idle before the first probe, seconds between probes, probes
+    int keepidle = 0, keepintvl = 0, keepcnt = 0;
+    // microseconds to busy poll the device queue on blocking reads and in
+    // epoll_wait(), needs CAP_NET_ADMIN beyond the sysctl's limit
+    int busy_poll = 0;
+    // IP_TOS, or the traffic class for ipv6
+    int tos = -1;
+
+    void apply_listener(Socket & sock) const {
+        apply(sock);
+        if (!is_tcp(sock))
+            return;
+        if (defer_accept)
+            set(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept, "TCP_DEFER_ACCEPT");
+        if (fastopen)
+            set(sock, IPPROTO_TCP, TCP_FASTOPEN, fastopen, "TCP_FASTOPEN");
+    }
+    // not inherited by accepted sockets
+    void apply_accepted(Socket & sock) const {
+        if (quickack)
+            set(sock, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    }
+    // before connect()
+    void apply_client(Socket & sock) const {
+        apply(sock);
+        if (!is_tcp(sock))
+            return;
+        if (quickack)
+            set(sock, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    #ifdef TCP_FASTOPEN_CONNECT
+        if (fastopen)
+            set(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+    #endif
+    }
+
+private:
+    static bool is_tcp(const Socket & sock) {
+        int domain = sock.getsockopt(SOL_SOCKET, SO_DOMAIN);
+        return domain == AF_INET || domain == AF_INET6;
+    }
+
+    static void set(Socket & sock, int level, int optname, int value, const char * name) {
+        if (sock.setsockopt(level, optname, value) < 0)
+            LOG(WARN) << "Setting " << name << " " << value << " on fd "
+                      << sock.fd() << " failed, errno " << errno;
+    }
+
+    void apply(Socket & sock) const {
+        if (rcvbuf)
+            set(sock, SOL_SOCKET, SO_RCVBUF, rcvbuf, "SO_RCVBUF");
+        if (sndbuf)
+            set(sock, SOL_SOCKET, SO_SNDBUF, sndbuf, "SO_SNDBUF");
+        if (busy_poll)
+            set(sock, SOL_SOCKET, SO_BUSY_POLL, busy_poll, "SO_BUSY_POLL");
+        if (!is_tcp(sock))
+            return;
+        if (keepalive)
+            set(sock, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+        if (nodelay)
+            set(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+        if (keepidle)
+            set(sock, IPPROTO_TCP, TCP_KEEPIDLE, keepidle, "TCP_KEEPIDLE");
+        if (keepintvl)
+            set(sock, IPPROTO_TCP, TCP_KEEPINTVL, keepintvl, "TCP_KEEPINTVL");
+        if (keepcnt)
+            set(sock, IPPROTO_TCP, TCP_KEEPCNT, keepcnt, "TCP_KEEPCNT");
+        if (user_timeout)
+            set(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, user_timeout, "TCP_USER_TIMEOUT");
+        if (tos >= 0) {
+            if (sock.getsockopt(SOL_SOCKET, SO_DOMAIN) == AF_INET6)
+                set(sock, IPPROTO_IPV6, IPV6_TCLASS, tos, "IPV6_TCLASS");
+            else
+                set(sock, IPPROTO_IP, IP_TOS, tos, "IP_TOS");
+        }
+    }
+};
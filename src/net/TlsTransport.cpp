@@ -0,0 +1,336 @@
+#include "TlsTransport.h"
+#if NETYO_TLS
+#include <openssl/err.h>
+#include <unistd.h>
+#include <climits>
+
+using namespace std;
+
+
+// the queued OpenSSL errors of the calling thread, which are cleared
+static string ssl_errors() {
+    string errors;
+    char buf[256];
+    while (unsigned long error = ERR_get_error()) {
+        ERR_error_string_n(error, buf, sizeof(buf));
+        if (errors.size())
+            errors += "; ";
+        errors += buf;
+    }
+    return errors.size() ? errors : "errno " + to_string(errno);
+}
+
+/**********************************TlsContext**********************************/
+
+TlsContext::TlsContext(SSL_CTX* ctx, bool server) : ctx(ctx), server(server) {
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // writes are retried from wherever the front of wbuffer is by then
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                        | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // peers closing without close_notify read as eof
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+    set_ktls(true);
+}
+
+TlsContext::~TlsContext() {
+    SSL_CTX_free(ctx);
+}
+
+shared_ptr<TlsContext> TlsContext::server_context(const string & cert_file,
+                                                  const string & key_file) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        LOG(ERROR) << "Creating TLS context failed: " << ssl_errors();
+        return nullptr;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        LOG(ERROR) << "Loading " << cert_file << " and " << key_file
+                   << " failed: " << ssl_errors();
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    return make_shared<TlsContext>(ctx, true);
+}
+
+shared_ptr<TlsContext> TlsContext::client_context(bool verify, const string & ca_file) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        LOG(ERROR) << "Creating TLS context failed: " << ssl_errors();
+        return nullptr;
+    }
+    if (verify) {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+        int res = ca_file.empty()
+                ? SSL_CTX_set_default_verify_paths(ctx)
+                : SSL_CTX_load_verify_locations(ctx, ca_file.c_str(), nullptr);
+        if (res != 1) {
+            LOG(ERROR) << "Loading CAs " << ca_file << " failed: " << ssl_errors();
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
+    }
+    return make_shared<TlsContext>(ctx, false);
+}
+
+void TlsContext::set_ktls(bool enable) {
+#ifdef SSL_OP_ENABLE_KTLS
+    if (enable)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    else
+        SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+/*********************************TlsTransport*********************************/
+
+TlsTransport::TlsTransport(
+    EventLoop* loop,
+    Socket && socket,
+    chrono::seconds timeout,
+    Protocol* protocol,
+    Channel::Protocol* channel_protocol,
+    shared_ptr<TlsContext> context,
+    const string & server_name)
+    : TcpTransport(loop, move(socket), timeout, protocol, channel_protocol),
+      context(move(context)),
+      ssl(SSL_new(this->context->native())) {
+    if (!ssl) {
+        LOG(ERROR) << "Creating TLS session failed: " << ssl_errors();
+        return;
+    }
+    // a socket BIO, which kTLS needs
+    SSL_set_fd(ssl, this->socket.fd());
+    if (this->context->is_server()) {
+        SSL_set_accept_state(ssl);
+    }
+    else {
+        SSL_set_connect_state(ssl);
+        if (server_name.size()) {
+            SSL_set_tlsext_host_name(ssl, server_name.c_str());
+            SSL_set1_host(ssl, server_name.c_str());
+        }
+    }
+}
+
+TlsTransport::~TlsTransport() {
+    if (ssl)
+        SSL_free(ssl);
+}
+
+bool TlsTransport::activate() {
+    loop->call_soon([=, this]() {
+        own_buffers(true);
+        resume_reading_for(0);
+        set_state(ACTIVATED);
+        reset_timeout();
+        handshake();
+    });
+    return true;
+}
+
+void TlsTransport::handshake() {
+    if (!ssl) {
+        force_close();
+        return;
+    }
+    ERR_clear_error();
+    int res = SSL_do_handshake(ssl);
+    if (res != 1) {
+        int error = SSL_get_error(ssl, res);
+        if (error == SSL_ERROR_WANT_READ) {
+            pause_writing();
+        }
+        else if (error == SSL_ERROR_WANT_WRITE) {
+            resume_writing();
+        }
+        else {
+            LOG(WARN) << "TLS handshake on fd " << socket.fd() << " failed: " << ssl_errors();
+            force_close();
+        }
+        return;
+    }
+    handshaking = false;
+    ktls_tx = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    // whole records and what follows at once, kTLS reads them itself
+    if (!ktls_rx)
+        SSL_set_read_ahead(ssl, 1);
+    pause_writing();
+    if (protocol->connection_made_cb)
+        protocol->connection_made_cb(*this);
+    if (closed())
+        return;
+    // sent while handshaking
+    schedule_flush();
+    // the peer may have sent right after its Finished, edge triggered
+    handle_onread();
+}
+
+void TlsTransport::handle_onread() {
+    if (handshaking) {
+        handshake();
+        return;
+    }
+    TcpTransport::handle_onread();
+    if (broken && !closed())
+        force_close();
+}
+
+void TlsTransport::handle_onwrite() {
+    if (handshaking) {
+        handshake();
+        return;
+    }
+    TcpTransport::handle_onwrite();
+}
+
+void TlsTransport::flush() {
+    if (handshaking) {
+        dirty = false;
+        return;
+    }
+    TcpTransport::flush();
+}
+
+ssize_t TlsTransport::read_ssl() {
+    ssize_t total = 0;
+    for (;;) {
+        auto [data, room] = rbuffer.prepare(RECORD_SIZE);
+        ERR_clear_error();
+        int n = SSL_read(ssl, data, static_cast<int>(min<ssize_t>(room, INT_MAX)));
+        if (n > 0) {
+            rbuffer.commit(n);
+            total += n;
+            if (!read_budget || total < static_cast<ssize_t>(read_budget))
+                continue;
+            // records left are buffered by OpenSSL, read next iteration
+            LoopMetrics::local().bytes_read.inc(total);
+            return total;
+        }
+        int error = SSL_get_error(ssl, n);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            errno = EAGAIN;
+            n = -1;
+        }
+        else if (error != SSL_ERROR_ZERO_RETURN) {
+            // silent when the peer went away, like with plain reads
+            if (ERR_peek_error())
+                LOG(WARN) << "TLS read on fd " << socket.fd() << " failed: " << ssl_errors();
+            broken = true;
+            errno = EPROTO;
+            n = -1;
+        }
+        if (total > 0) {
+            LoopMetrics::local().bytes_read.inc(total);
+            return total;
+        }
+        // 0 for eof(close_notify or not)
+        return n;
+    }
+}
+
+ssize_t TlsTransport::read_socket() {
+    if (!ktls_rx)
+        return read_ssl();
+    errno = 0;
+    ssize_t res = rbuffer.feed_rbuffer(socket.fd(), nullptr, 0, nullptr, read_budget);
+    // a record other than application data, e.g. a session ticket or an
+    // alert, is left to OpenSSL
+    if (errno == EIO) {
+        ssize_t more = read_ssl();
+        if (res > 0)
+            return more > 0 ? res + more : res;
+        return more;
+    }
+    return res;
+}
+
+ssize_t TlsTransport::write_ssl(const char * data, size_t len) {
+    // the same length again after SSL_write() asked for a retry
+    if (retry_len)
+        len = retry_len;
+    ERR_clear_error();
+    int n = SSL_write(ssl, data, static_cast<int>(min<size_t>(len, INT_MAX)));
+    if (n > 0) {
+        retry_len = 0;
+        LoopMetrics::local().bytes_written.inc(n);
+        return n;
+    }
+    int error = SSL_get_error(ssl, n);
+    if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) {
+        retry_len = len;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (ERR_peek_error())
+        LOG(WARN) << "TLS write on fd " << socket.fd() << " failed: " << ssl_errors();
+    errno = EPIPE;
+    return -1;
+}
+
+ssize_t TlsTransport::write_socket() {
+    if (ktls_tx)
+        return TcpTransport::write_socket();
+    for (;;) {
+        ssize_t res;
+        if (!files.empty() && wbuffer.begin_offset() >= files.front().at) {
+            auto & file = files.front();
+            if (file_block.empty()) {
+                file_block.resize(min(file.count, RECORD_SIZE));
+                ssize_t n = ::pread(file.fd, file_block.data(), file_block.size(), file.offset);
+                if (n <= 0) {
+                    LOG(WARN) << "File fd " << file.fd << " ended " << file.count << " bytes early";
+                    file_block.clear();
+                    file_bytes -= file.count;
+                    ::close(file.fd);
+                    files.erase(files.begin());
+                    continue;
+                }
+                file_block.resize(n);
+            }
+            res = write_ssl(file_block.data(), file_block.size());
+            if (res > 0) {
+                file_block.erase(file_block.begin(), file_block.begin() + res);
+                file.offset += res;
+                file.count -= res;
+                file_bytes -= res;
+                if (!file.count) {
+                    ::close(file.fd);
+                    files.erase(files.begin());
+                }
+            }
+        }
+        else if (wbuffer.size()) {
+            auto [data, len] = wbuffer.peek();
+            ssize_t want = min<ssize_t>(wbuffer.size(), RECORD_SIZE);
+            // up to the next file
+            if (!files.empty())
+                want = min<ssize_t>(want, files.front().at - wbuffer.begin_offset());
+            if (len < want) {
+                record.resize(want);
+                data = record.data();
+                len = wbuffer.peek(record.data(), want);
+            }
+            res = write_ssl(data, min(len, want));
+            if (res > 0)
+                wbuffer.consume(res);
+        }
+        else {
+            return 0;
+        }
+        if (res < 0)
+            return errno == EAGAIN ? wbuffer.size() + file_bytes : res;
+    }
+}
+
+void TlsTransport::force_close() {
+    if (!closed() && ssl && !handshaking) {
+        // close_notify, best effort
+        ERR_clear_error();
+        SSL_shutdown(ssl);
+    }
+    TcpTransport::force_close();
+}
+#endif
@@ -0,0 +1,93 @@
+#pragma once
+#if NETYO_TLS
+#include "Transport.h"
+#include "../utils/Common.h"
+#include <openssl/ssl.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+// An SSL_CTX shared by the TlsTransports of a server or a client.
+class TlsContext : public NoCopyble {
+private:
+    SSL_CTX* ctx;
+    bool server;
+
+public:
+    TlsContext(SSL_CTX* ctx, bool server);
+    ~TlsContext();
+
+    // PEM files, nullptr if they can't be loaded
+    static shared_ptr<TlsContext> server_context(const string & cert_file,
+                                                 const string & key_file);
+    // peers are verified against ca_file, or the system's CAs if empty
+    static shared_ptr<TlsContext> client_context(bool verify = true,
+                                                 const string & ca_file = "");
+
+    SSL_CTX* native() const {
+        return ctx;
+    }
+    bool is_server() const {
+        return server;
+    }
+    // kernel TLS after the handshake where available, on by default
+    void set_ktls(bool enable);
+};
+
+
+// TcpTransport speaking TLS. The handshake runs first, the protocol's
+// connection_made_cb fires once it's done and sends are held back until then.
+// With kernel TLS(OpenSSL installs the session keys with
+// setsockopt(SOL_TLS, TLS_TX/TLS_RX)) reads and writes, sendfile() included,
+// go to the socket as plaintext. Without it OpenSSL encrypts in userspace.
+// OpenSSL writes with plain write(), loops block SIGPIPE for that.
+class TlsTransport : public TcpTransport {
+public:
+    // userspace reads and writes take one record at most
+    static constexpr size_t RECORD_SIZE = 16 * 1024;
+
+protected:
+    shared_ptr<TlsContext> context;
+    SSL* ssl = nullptr;
+    bool handshaking = true, ktls_tx = false, ktls_rx = false;
+    // a fatal TLS error after the data read before it
+    bool broken = false;
+    // an SSL_write() waiting for the socket, retried with the same length
+    size_t retry_len = 0;
+    // the front of wbuffer wrapped around, copied to go out as one record
+    vector<char> record;
+    // of the front file without kTLS, pread() into it for SSL_write()
+    vector<char> file_block;
+
+    void handshake();
+    ssize_t read_ssl();
+    ssize_t write_ssl(const char * data, size_t len);
+    ssize_t read_socket() override;
+    ssize_t write_socket() override;
+    void handle_onread() override;
+    void handle_onwrite() override;
+    void flush() override;
+
+public:
+    // server_name is verified and sent as SNI by clients
+    TlsTransport(EventLoop* loop, Socket && socket, chrono::seconds timeout,
+                 Protocol* protocol, Channel::Protocol* channel_protocol,
+                 shared_ptr<TlsContext> context, const string & server_name = "");
+    ~TlsTransport() override;
+
+    bool activate() override;
+    void force_close() override;
+    bool is_handshaking() const {
+        return handshaking;
+    }
+    bool is_ktls_tx() const {
+        return ktls_tx;
+    }
+    bool is_ktls_rx() const {
+        return ktls_rx;
+    }
+};
+#endif
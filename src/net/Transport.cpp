@@ -1,5 +1,6 @@
 #include "Transport.h"
 #include "eventloop/Channel.h"
+#include "eventloop/TimingWheel.h"
 #include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
@@ -7,7 +8,10 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <string>
 #include <iostream>
 
 using namespace std;
@@ -28,17 +32,14 @@ Channel::Protocol Transport::default_channel_protocol = {
     }
 };
 
+TcpTransport::Protocol TcpTransport::default_protocol = {};
+
 Transport::Transport(EventLoop* loop, Socket && socket, 
     Channel::Protocol * channel_protocol = &default_channel_protocol)
     : loop(loop), 
       socket(move(socket)),
       channel(this->socket.fd(), this, loop->selector.get(), channel_protocol) {
-    socket.setsockopt(SOL_SOCKET, SO_KEEPALIVE, true);
-    socket.setsockopt(IPPROTO_TCP, TCP_NODELAY, true);
-
-}
-
-Transport::~Transport() {
+    // options are set by servers and clients, see SocketOptions
 }
 
 bool Transport::operator()() {
@@ -59,11 +60,12 @@ Channel& Transport::get_channel() {
 }
 EventLoop* Transport::set_event_loop(EventLoop* loop) {
     EventLoop * prevloop = this->loop;
-    this->loop = loop;
+    atomic_ref(this->loop).store(loop, memory_order_release);
     return prevloop;
 }
 EventLoop* Transport::get_event_loop() const {
-    return loop;
+    // moved by the owning loop while others read it, see TcpTransport::migrate()
+    return atomic_ref(const_cast<EventLoop*&>(loop)).load(memory_order_acquire);
 }
 
 bool Transport::is_reading() {
@@ -73,11 +75,19 @@ bool Transport::is_writing() {
     return channel.is_writing();
 }
 void Transport::pause_reading() {
+    pause_reading_for(PAUSED_BY_USER);
+}
+void Transport::resume_reading() {
+    resume_reading_for(PAUSED_BY_USER);
+}
+void Transport::pause_reading_for(int reason) {
+    read_pauses |= reason;
     if (channel.is_reading())
         channel.disable(Channel::READ);
 }
-void Transport::resume_reading() {
-    if (!channel.is_reading())
+void Transport::resume_reading_for(int reason) {
+    read_pauses &= ~reason;
+    if (!read_pauses && !channel.is_reading())
         channel.enable(Channel::READ);
 }
 void Transport::pause_writing() {
@@ -98,53 +108,315 @@ bool Transport::closed() {
     return state() == DISCONNECTED;
 }
 
-/**********************************TcpTransport********************************/
+// Sends of one loop iteration are written once all its events, tasks, timers
+// and pollers ran, one syscall per transport instead of one EPOLLOUT round trip
+// per send. Only what the socket does not take at once waits for EPOLLOUT.
+// Dirty transports are held until flushed, whichever thread drops their last
+// reference meanwhile. The flusher belongs to its loop and releases what is
+// left when the loop is destroyed.
+class Transport::WriteFlusher {
+private:
+    EventLoop* loop = nullptr;
+    vector<shared_ptr<Transport>> dirty, flushing;
+
+    // of the calling thread
+    static WriteFlusher*& current() {
+        static thread_local WriteFlusher* flusher = nullptr;
+        return flusher;
+    }
 
-void TcpTransport::reset_timeout() {
-    if (timeout > 0s && steady_clock::now() - last_active > 3s) {
-        if (protocol->reset_timeout_cb) {
-            protocol->reset_timeout_cb(shared_from_this(), timeout);
-            last_active = steady_clock::now();
+    bool flush() {
+        swap(dirty, flushing);
+        // flushing transports may be dirtied again meanwhile
+        for (size_t i = 0; i < flushing.size(); ++i)
+            flushing[i]->flush();
+        flushing.clear();
+        return !dirty.empty();
+    }
+
+public:
+    ~WriteFlusher() {
+        if (current() == this)
+            current() = nullptr;
+    }
+    // within loop's thread, the flush runs as the loop's flusher
+    static WriteFlusher& of(EventLoop* loop);
+    void add(shared_ptr<Transport> transport) {
+        dirty.push_back(move(transport));
+    }
+};
+
+// Transports that stopped reading before EAGAIN, read again by a poller. The
+// WriteFlusher runs after all pollers, so their responses are flushed within
+// the same iteration, and the next select() doesn't block. Held like dirty
+// ones.
+class Transport::ReadScheduler {
+private:
+    EventLoop* loop = nullptr;
+    vector<shared_ptr<Transport>> pending, reading;
+
+    static ReadScheduler*& current() {
+        static thread_local ReadScheduler* scheduler = nullptr;
+        return scheduler;
+    }
+
+    bool read() {
+        swap(pending, reading);
+        for (size_t i = 0; i < reading.size(); ++i) {
+            auto & transport = reading[i];
+            transport->read_pending = false;
+            if (!transport->closed() && transport->is_reading())
+                transport->handle_onread();
+        }
+        reading.clear();
+        return !pending.empty();
+    }
+
+public:
+    ~ReadScheduler() {
+        if (current() == this)
+            current() = nullptr;
+    }
+    // within loop's thread, owned by the loop's poller
+    static ReadScheduler& of(EventLoop* loop) {
+        auto & scheduler = current();
+        if (!scheduler || scheduler->loop != loop) {
+            auto owned = make_shared<ReadScheduler>();
+            owned->loop = loop;
+            scheduler = owned.get();
+            loop->add_poller([owned]() { return owned->read(); });
         }
+        return *scheduler;
+    }
+    void add(shared_ptr<Transport> transport) {
+        pending.push_back(move(transport));
+    }
+};
+
+Transport::WriteFlusher& Transport::WriteFlusher::of(EventLoop* loop) {
+    auto & flusher = current();
+    if (!flusher || flusher->loop != loop) {
+        auto owned = make_shared<WriteFlusher>();
+        owned->loop = loop;
+        flusher = owned.get();
+        loop->set_flusher([owned]() { return owned->flush(); });
+    }
+    return *flusher;
+}
+
+void Transport::schedule_flush() {
+    // with EPOLLOUT enabled handle_onwrite() takes care of it
+    if (!dirty && !is_writing()) {
+        dirty = true;
+        WriteFlusher::of(loop).add(shared_from_this());
+    }
+}
+
+void Transport::schedule_read() {
+    if (!read_pending) {
+        read_pending = true;
+        ReadScheduler::of(loop).add(shared_from_this());
     }
 }
 
+Transport::~Transport() {}
+
+/**********************************TcpTransport********************************/
+
+class TcpTransport::TimeoutEntry {
+private:
+    weak_ptr<Transport> conn;
+public:
+    explicit TimeoutEntry(const weak_ptr<Transport> & conn) : conn(conn) {}
+    ~TimeoutEntry() {
+        auto sp = conn.lock();
+        // wheels are also destroyed with their loop, nothing expires then
+        if (sp && !sp->get_event_loop()->is_closed()) {
+            sp->force_close();
+        }
+    }
+    void cancel() { conn.reset(); }
+};
 
+void TcpTransport::reset_timeout() {
+    if (timeout <= 0s || closed())
+        return;
+    if (protocol->reset_timeout_cb) {
+        protocol->reset_timeout_cb(shared_from_this(), timeout);
+        return;
+    }
+    // everything happens in the owning loop, refreshing more than once
+    // within a tick can not move the deadline.
+    auto & wheel = loop->timing_wheel();
+    auto entry = timeout_entry.lock();
+    if (entry && wheel.ticks() == last_refresh_tick)
+        return;
+    if (!entry) {
+        entry = allocate_shared<TimeoutEntry>(PoolAllocator<TimeoutEntry>(),
+                                              weak_from_this());
+        timeout_entry = entry;
+    }
+    wheel.insert_in_loop(timeout.count(), move(entry));
+    last_refresh_tick = wheel.ticks();
+}
 
 void TcpTransport::handle_onread() {
     loop->assert_within_self_thread();
+    // over budget already, read after the events of this iteration
+    if (read_pending)
+        return;
 
-    int nbytes = rbuffer.feed_rbuffer(socket.fd());
+    // under pressure connections holding more than large_consumer bytes stop
+    // reading, resumed by the budget
+    auto budget = loop->memory_budget();
+    if (budget && budget->under_pressure(loop->index()))
+        rbuffer.shrink();
+    if (budget && budget->should_pause(loop->index(), rbuffer.vsize() + wbuffer.vsize())) {
+        pause_reading_for(PAUSED_BY_BUDGET);
+        budget->paused(loop->index(), [conn = weak_from_this()]() {
+            if (auto sp = conn.lock(); sp && !sp->closed())
+                sp->resume_reading_for(PAUSED_BY_BUDGET);
+        });
+        return;
+    }
+    ssize_t nbytes = read_socket();
+    // the rest is left for the next iteration, level triggered channels are
+    // reported again anyway
+    if (read_budget && nbytes >= static_cast<ssize_t>(read_budget)
+        && channel.is_edge_triggered())
+        schedule_read();
     if (nbytes < 0) {
         handle_onerror();   
     }
     else if (nbytes == 0) {
         if (protocol->eof_received_cb)
-            protocol->eof_received_cb(shared_from_this());
+            protocol->eof_received_cb(*this);
     }
     else {
+        bytes_received.inc(nbytes);
         reset_timeout();
-        if (protocol->data_received_cb)
-            protocol->data_received_cb(shared_from_this());
+        auto & metrics = LoopMetrics::local();
+        bool sampled = metrics.sample_latency();
+        // readiness is the time select() returned
+        if (sampled && !awaiting_write) {
+            awaiting_write = true;
+            read_ready_at = loop->now();
+        }
+        if (!protocol->data_received_cb)
+            return;
+        if (!sampled) {
+            protocol->data_received_cb(*this);
+            return;
+        }
+        // the callback may drop the last reference to this transport
+        auto latency = this->latency;
+        auto start = EventLoop::precise_now();
+        protocol->data_received_cb(*this);
+        auto elapsed = duration_cast<nanoseconds>(
+            EventLoop::precise_now() - start).count();
+        metrics.handler_time.record(elapsed);
+        if (latency)
+            latency->handler_time.record(elapsed);
     }
 }
 
+void TcpTransport::flush() {
+    dirty = false;
+    if (closed() || is_writing() || (wbuffer.empty() && files.empty()))
+        return;
+    if (corked && wbuffer.size() <= write_highlevel)
+        return;
+    handle_onwrite();
+}
+
+void TcpTransport::cork() {
+    corked = true;
+}
+
+void TcpTransport::uncork() {
+    corked = false;
+    schedule_flush();
+}
+
+ssize_t TcpTransport::read_socket() {
+    return rbuffer.feed_rbuffer(socket.fd(), nullptr, 0, nullptr, read_budget);
+}
+
+ssize_t TcpTransport::write_socket() {
+    int flags = corked ? MSG_MORE : 0;
+    while (!files.empty()) {
+        auto & file = files.front();
+        // what was sent before the file goes first
+        if (wbuffer.begin_offset() < file.at) {
+            ssize_t res = wbuffer.send_wbuffer(socket.fd(), flags | MSG_MORE,
+                                               file.at - wbuffer.begin_offset());
+            if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                return res;
+            if (res < 0 || wbuffer.begin_offset() < file.at)
+                return wbuffer.size() + file_bytes;
+            continue;
+        }
+        ssize_t n = ::sendfile(socket.fd(), file.fd, &file.offset, file.count);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return n;
+        if (n < 0)
+            return wbuffer.size() + file_bytes;
+        LoopMetrics::local().bytes_written.inc(n);
+        file.count -= n;
+        file_bytes -= n;
+        if (n && file.count)
+            return wbuffer.size() + file_bytes;
+        if (file.count) {
+            LOG(WARN) << "File fd " << file.fd << " ended " << file.count << " bytes early";
+            file_bytes -= file.count;
+        }
+        ::close(file.fd);
+        files.erase(files.begin());
+    }
+    return wbuffer.send_wbuffer(socket.fd(), flags);
+}
+
+void TcpTransport::drop_files() {
+    for (auto & file : files)
+        ::close(file.fd);
+    files.clear();
+    file_bytes = 0;
+}
+
 void TcpTransport::handle_onwrite() {
     loop->assert_within_self_thread();
-    if (!is_writing()) {
-
+    size_t pending = wbuffer.size() + file_bytes;
+    ssize_t res = write_socket();
+    // not writable yet, e.g. written from the end of iteration flush
+    if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        res = pending;
+    if (awaiting_write && res >= 0 && static_cast<size_t>(res) < pending) {
+        awaiting_write = false;
+        auto elapsed = duration_cast<nanoseconds>(
+            EventLoop::precise_now() - read_ready_at).count();
+        LoopMetrics::local().first_write_latency.record(elapsed);
+        if (latency)
+            latency->first_write_latency.record(elapsed);
     }
-    int res = wbuffer.drain_wbuffer(socket.fd());
+    if (res >= 0)
+        check_watermarks();
     if (res == 0) {
+        if (auto budget = loop->memory_budget();
+            budget && budget->under_pressure(loop->index()))
+            wbuffer.shrink();
         pause_writing();
         if (protocol->done_writing_cb)
-            protocol->done_writing_cb(shared_from_this());
+            protocol->done_writing_cb(*this);
         if (is_closing()) {
             force_close();
         }
     }
-    else if (res < 0) {
-        handle_onerror();
+    else if (res > 0) {
+        resume_writing();
+    }
+    else {
+        // EPIPE/ECONNRESET, SO_ERROR is already cleared by then
+        force_close();
     }
 }
 
@@ -169,7 +441,10 @@ void TcpTransport::handle_onerror() {
 void TcpTransport::close() {
     if (is_closing() || closed())
         return;
-    if (is_writing()) {
+    // corked or flushed at the end of the iteration, written before closing
+    if (!wbuffer.empty() || !files.empty()) {
+        corked = false;
+        schedule_flush();
         socket.shutdown(SHUT_RD);
         set_state(DISCONNECTING);
     }
@@ -183,8 +458,20 @@ void TcpTransport::force_close() {
         set_state(DISCONNECTED);
         channel.destroy();
         socket.shutdown(SHUT_RDWR);
+        drop_files();
+        // the wheel's references expire later, they must not keep the
+        // transport's block alive until then
+        if (auto entry = timeout_entry.lock())
+            entry->cancel();
+        // the owner may release it from another loop, e.g. a server's
+        own_buffers(false);
+        // the upstream may have to notice the loss by reading
+        if (write_congested) {
+            write_congested = false;
+            pause_upstream(false);
+        }
         if (protocol->connection_lost_cb)
-            protocol->connection_lost_cb(shared_from_this());
+            protocol->connection_lost_cb(*this);
     }
     else {
 
@@ -201,17 +488,97 @@ TcpTransport::TcpTransport(
     : timeout(timeout), 
       Transport(loop, move(socket), channel_protocol),
       protocol(protocol) {
+    // accounted by the loop once activated there
+    own_buffers(false);
+}
+
+void TcpTransport::own_buffers(bool own) {
+    if (own) {
+        rbuffer.own();
+        wbuffer.own();
+    }
+    else {
+        rbuffer.disown();
+        wbuffer.disown();
+    }
 }
 
 TcpTransport::~TcpTransport() {
-    force_close();
+    // no owner is left to pass to the protocol, close silently
+    if (!closed()) {
+        set_state(DISCONNECTED);
+        channel.destroy();
+    }
+    drop_files();
+}
+
+void TcpTransport::set_timeout(chrono::seconds timeout) {
+    run_in_loop([=, this]() {
+        this->timeout = timeout;
+        // disarm the old deadline, the new one takes effect from now on
+        if (auto entry = timeout_entry.lock())
+            entry->cancel();
+        timeout_entry.reset();
+        reset_timeout();
+    });
+}
+
+void TcpTransport::set_latency_stats(ConnectionLatency* latency) {
+    this->latency = latency;
+}
+
+void TcpTransport::set_write_watermarks(size_t high, size_t low) {
+    write_highlevel = high;
+    write_lowlevel = min(low, high);
+    check_watermarks();
+}
+
+bool TcpTransport::is_write_congested() const {
+    return write_congested;
+}
+
+void TcpTransport::set_upstream(const shared_ptr<Transport> & upstream) {
+    this->upstream = upstream;
+    if (write_congested)
+        pause_upstream(true);
+}
+
+void TcpTransport::pause_upstream(bool pause) {
+    if (auto up = upstream.lock()) {
+        up->run_in_loop([up, pause]() {
+            if (up->closed())
+                return;
+            if (pause)
+                up->pause_reading_for(PAUSED_BY_FLOW);
+            else
+                up->resume_reading_for(PAUSED_BY_FLOW);
+        });
+    }
+}
+
+// each crossing fires once, the callbacks may send or close
+void TcpTransport::check_watermarks() {
+    bool congested;
+    if (!write_congested && wbuffer.size() > write_highlevel)
+        congested = true;
+    else if (write_congested && wbuffer.size() <= write_lowlevel)
+        congested = false;
+    else
+        return;
+    write_congested = congested;
+    pause_upstream(congested);
+    auto & cb = congested ? protocol->pause_writing_cb : protocol->resume_writing_cb;
+    if (cb)
+        cb(*this);
 }
 
 bool TcpTransport::activate() {
-    loop->call_soon([=]() {
+    loop->call_soon([=, this]() {
+        own_buffers(true);
         if (protocol->connection_made_cb)
-            protocol->connection_made_cb(shared_from_this());
-        resume_reading();
+            protocol->connection_made_cb(*this);
+        // unless paused meanwhile, e.g. by connection_made_cb
+        resume_reading_for(0);
         set_state(ACTIVATED);
         reset_timeout();
     });
@@ -226,24 +593,90 @@ void* TcpTransport::set_transport_protocol(void * protocol) {
 void* TcpTransport::get_transport_protocol() const {
     return protocol;
 }
+void TcpTransport::queue_send(const void* data, size_t len) {
+    reset_timeout();
+    wbuffer.feed_wbuffer(data, len);
+    schedule_flush();
+    check_watermarks();
+}
+
 void TcpTransport::send(const void* data, size_t len) {
-    // need mutex? or some times(when there are no send_in_loop in queue) can just call send_in_loop?
-    if (len) {
-        loop->call_soon([=](){
-            if (state() != ACTIVATED) {
-
-            }
-            reset_timeout();
-            size_t bytes_write = wbuffer.feed_wbuffer(data, len);
-            if (!is_writing())
-                resume_writing();
-            if (wbuffer.size() > write_highlevel && protocol->pause_writing_cb)
-                protocol->pause_writing_cb(shared_from_this());
-        });
+    if (!len)
+        return;
+    if (get_event_loop()->within_self_thread()) {
+        queue_send(data, len);
+        return;
     }
+    // queued, the caller's buffer may be gone by the time the loop runs it
+    run_in_loop([this, bytes = string(static_cast<const char*>(data), len)]() {
+        queue_send(bytes.data(), bytes.size());
+    });
 }
-void TcpTransport::send_file() {
-    // wait for implement
+void TcpTransport::send_file(int fd, off_t offset, size_t count) {
+    if (!count)
+        return;
+    int dup = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dup < 0) {
+        LOG(ERROR) << "Duplicating fd " << fd << " failed, errno " << errno;
+        return;
+    }
+    run_in_loop([=, this]() {
+        if (is_closing() || closed()) {
+            ::close(dup);
+            return;
+        }
+        reset_timeout();
+        files.push_back({wbuffer.end_offset(), dup, offset, count});
+        file_bytes += count;
+        schedule_flush();
+    });
+}
+
+bool TcpTransport::is_idle() {
+    return activated() && !migrating && !dirty && !read_pending && !corked && is_reading()
+        && !is_writing() && wbuffer.empty() && files.empty();
+}
+
+bool TcpTransport::migrate(EventLoop* target, ConnectionLatency* latency) {
+    loop->assert_within_self_thread();
+    if (target == loop)
+        return true;
+    if (!is_idle())
+        return false;
+    migrating = true;
+    // events of this iteration may still be dispatched to the channel,
+    // timers run after them
+    loop->call_at([this, self = shared_from_this(), target, latency]() {
+        migrating = false;
+        hand_over(target, latency);
+    }, EventLoop::precise_now());
+    return true;
+}
+
+// Within the old loop, which lets go of the transport as its last step. From
+// then on the transport is only touched within target.
+void TcpTransport::hand_over(EventLoop* target, ConnectionLatency* latency) {
+    // written to meanwhile
+    if (!is_idle())
+        return;
+    channel.move_to(target->selector.get());
+    if (auto entry = timeout_entry.lock())
+        entry->cancel();
+    timeout_entry.reset();
+    awaiting_write = false;
+    this->latency = latency;
+    own_buffers(false);
+    LoopMetrics::local().migrations_out.inc();
+    atomic_ref(loop).store(target, memory_order_release);
+    target->call_soon([this, self = shared_from_this()]() {
+        LoopMetrics::local().migrations_in.inc();
+        if (closed())
+            return;
+        own_buffers(true);
+        // registered again, pending input is reported right away
+        channel.notify();
+        reset_timeout();
+    });
 }
 
 /***************************TcpServer*******************************/
@@ -253,9 +686,9 @@ TcpServerAcceptor::~TcpServerAcceptor() {
 }
 
 bool TcpServerAcceptor::activate() {
-    loop->call_soon([=]() {
-        socket.setsockopt(SOL_SOCKET, SO_KEEPALIVE, true);
-        resume_reading();
+    // its buffers stay unused and unaccounted
+    loop->call_soon([=, this]() {
+        resume_reading_for(0);
         set_state(ACTIVATED);
     });
     return true;
@@ -267,6 +700,6 @@ void TcpServerAcceptor::handle_onread() {
         handle_onclose();
     }
     else {
-        protocol->data_received_cb(shared_from_this());
+        protocol->data_received_cb(*this);
     }
 }
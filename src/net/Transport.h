@@ -4,8 +4,10 @@
 #include "eventloop/ThreadingEventLoop.h"
 #include <memory>
 #include <queue>
+#include <vector>
 #include "Socket.h"
 #include "Buffer.h"
+#include "../utils/Metrics.h"
 #include <chrono>
 
 
@@ -19,7 +21,23 @@ protected:
     EventLoop * loop = nullptr;
     Socket socket;
     Channel channel;
+    // queued to the loop's end of iteration flush, see schedule_flush()
+    class WriteFlusher;
+    bool dirty = false;
+    // queued to read again next iteration, see schedule_read()
+    class ReadScheduler;
+    bool read_pending = false;
+    // PauseReasons reading is paused for
+    int read_pauses = 0;
 
+    // flush() runs once all events, tasks and timers of the current
+    // iteration ran, unless EPOLLOUT is enabled already. Within the loop.
+    void schedule_flush();
+    // handle_onread() runs again after the events of the next iteration,
+    // without waiting for the fd to be reported, e.g. once an edge triggered
+    // transport used up its read budget. Within the loop.
+    void schedule_read();
+    virtual void flush() {}
     virtual void handle_onread() = 0;
     virtual void handle_onwrite() = 0;
     virtual void handle_onclose() = 0;
@@ -40,14 +58,32 @@ public:
     Channel& get_channel();
     EventLoop* set_event_loop(EventLoop* loop);
     EventLoop* get_event_loop() const;
+    // cb runs within the owning loop, it follows the transport there if the
+    // transport moved to another loop meanwhile(see TcpTransport::migrate())
+    template <typename CallBack>
+    void run_in_loop(CallBack && cb) {
+        EventLoop* target = get_event_loop();
+        target->call_soon([this, target, cb = forward<CallBack>(cb)]() mutable {
+            if (loop != target)
+                run_in_loop(move(cb));
+            else
+                cb();
+        });
+    }
 
     virtual bool activated();
     virtual bool is_closing();
     virtual bool closed();
     virtual bool is_reading();
     virtual bool is_writing();
+    // paused by the user, resumed by the user only
     virtual void pause_reading();
     virtual void resume_reading();
+    // reading is resumed once every reason it was paused for is gone
+    enum PauseReasons {PAUSED_BY_USER = 1, PAUSED_BY_FLOW = 2, PAUSED_BY_BUDGET = 4};
+    void pause_reading_for(int reason);
+    // 0 resumes unless paused for any reason, e.g. on activation
+    void resume_reading_for(int reason);
     virtual void pause_writing();
     virtual void resume_writing();
 
@@ -55,16 +91,59 @@ public:
     virtual void* set_transport_protocol(void * protocol) = 0;
     virtual void* get_transport_protocol() const = 0;
     virtual void send(const void* data, size_t len) = 0;
-    virtual void send_file() = 0;
+    virtual void send_file(int fd, off_t offset, size_t count) = 0;
     virtual void close() = 0;
     virtual void force_close() = 0;
 };
 
 
+// A protocol callback taking either a Transport& or a shared_ptr<Transport>.
+// The reference is only valid during the call within the owning loop, no
+// reference count is taken for it, which saves two atomic operations per
+// event. Callbacks retaining the connection take a shared_ptr(or call
+// shared_from_this()), generic lambdas(auto pconn) get one as well.
+class TransportCallBack {
+private:
+    function<void(Transport&)> cb;
+
+public:
+    TransportCallBack() = default;
+    TransportCallBack(nullptr_t) {}
+    template <typename F, typename = enable_if_t<!is_same_v<decay_t<F>, TransportCallBack>>>
+    TransportCallBack(F && f) {
+        if constexpr (is_invocable_v<decay_t<F>&, shared_ptr<Transport>>) {
+            cb = [f = forward<F>(f)](Transport & conn) mutable {
+                f(conn.shared_from_this());
+            };
+        }
+        else {
+            cb = forward<F>(f);
+        }
+    }
+
+    explicit operator bool() const {
+        return static_cast<bool>(cb);
+    }
+    void operator()(Transport & conn) const {
+        cb(conn);
+    }
+    void operator()(const shared_ptr<Transport> & conn) const {
+        cb(*conn);
+    }
+};
+
+
+// Latency of the connections of one server within one loop, sampled like the
+// loop's, see TcpServer::collect().
+struct ConnectionLatency {
+    LatencyHistogram handler_time, first_write_latency;
+};
+
+
 class TcpTransport : public Transport {
 public:
     struct Protocol {
-        using CallBack = function<void(shared_ptr<Transport>)>;
+        using CallBack = TransportCallBack;
         CallBack connection_made_cb,
                  data_received_cb,
                  pause_writing_cb,
@@ -78,10 +157,55 @@ public:
 protected:
     Protocol* protocol = nullptr;
     chrono::seconds timeout = 0s;
-    chrono::time_point<chrono::steady_clock> last_active;
+    // held by the owning loop's TimingWheel, expiring it closes the transport
+    class TimeoutEntry;
+    weak_ptr<TimeoutEntry> timeout_entry;
+    size_t last_refresh_tick = 0;
+    // the server's histograms for this loop, if any
+    ConnectionLatency* latency = nullptr;
+    // a sampled read is waiting for its first response write since then
+    Time read_ready_at;
+    bool awaiting_write = false;
+    // above the high watermark until drained to the low one
+    bool write_congested = false;
+    // paused while this transport is congested, e.g. the client side of a
+    // proxied connection
+    weak_ptr<Transport> upstream;
+    bool corked = false;
+    // bytes read so far, e.g. for rebalancing loops from another thread
+    Counter bytes_received;
+    // bytes_received at the last received_since_mark(), a recycled transport
+    // starts over
+    uint64_t received_mark = 0;
+    bool migrating = false;
+    // queued by send_file(), sent once wbuffer is written up to offset at
+    struct FileChunk {
+        uint64_t at;
+        int fd;
+        off_t offset;
+        size_t count;
+    };
+    // rarely more than a few, unlike a deque an empty vector allocates nothing
+    vector<FileChunk> files;
+    size_t file_bytes = 0;
 
     void reset_timeout();
+    // into wbuffer, within the loop
+    void queue_send(const void* data, size_t len);
+    // rbuffer and wbuffer accounted by the calling loop or not, see
+    // Buffer::own()
+    void own_buffers(bool own);
+    void flush() override;
+    // into rbuffer, the feed_rbuffer() result
+    virtual ssize_t read_socket();
+    // wbuffer and the files, the bytes left or -1 with errno
+    virtual ssize_t write_socket();
+    void drop_files();
+    bool is_idle();
+    void hand_over(EventLoop* target, ConnectionLatency* latency);
     void done_writing();
+    void check_watermarks();
+    void pause_upstream(bool pause);
 
     void handle_onread() override;
     void handle_onwrite() override;
@@ -89,18 +213,56 @@ protected:
     void handle_onerror() override;
 public:
     static Protocol default_protocol;
-    size_t write_highlevel = 4000, read_lowlevel = 500;
+    // pause_writing_cb fires once wbuffer grows above write_highlevel,
+    // resume_writing_cb once it's drained to write_lowlevel again.
+    size_t write_highlevel = 64 * 1024, write_lowlevel = 16 * 1024;
+    // bytes read per loop iteration(0 for no limit) before the other
+    // connections of the loop get their turn, the rest is read next iteration
+    size_t read_budget = 64 * 1024;
 
     TcpTransport(EventLoop* loop, Socket && socket, chrono::seconds timeout,
                  Protocol* protocol, 
                  Channel::Protocol* channel_protocol);
 
     ~TcpTransport() override;
+    void set_timeout(chrono::seconds timeout);
+    // within the loop's thread, before activate()
+    void set_latency_stats(ConnectionLatency* latency);
+    // within the loop's thread, low is capped to high
+    void set_write_watermarks(size_t high, size_t low);
+    bool is_write_congested() const;
+    uint64_t received() const {
+        return bytes_received.value();
+    }
+    // bytes received since the previous call, for a single caller such as
+    // TcpServer::rebalance()
+    uint64_t received_since_mark() {
+        uint64_t received = this->received(), delta = received - received_mark;
+        received_mark = received;
+        return delta;
+    }
+    // within the loop's thread: moves the transport to target within this
+    // iteration, latency(e.g. the server's of target) replaces the current
+    // histograms. Only an idle transport moves: activated, reading and
+    // nothing left to write, false otherwise. Buffered input and the idle
+    // timeout move along, tasks still queued to this loop follow it.
+    bool migrate(EventLoop* target, ConnectionLatency* latency = nullptr);
+    // reading of upstream(maybe this transport itself) is paused while this
+    // transport is congested and resumed once it's drained, in upstream's
+    // own loop. Within the loop's thread, nullptr detaches.
+    void set_upstream(const shared_ptr<Transport> & upstream);
     bool activate() override;
     void* set_transport_protocol(void * protocol) override;
     void* get_transport_protocol() const override;
     void send(const void* data, size_t len) override;
-    void send_file() override;
+    // within the loop's thread: sends are held back until uncork(), e.g. for
+    // a response made of several sends. Data beyond write_highlevel still
+    // goes out, with MSG_MORE so that the kernel holds back partial segments.
+    void cork();
+    void uncork();
+    // count bytes of fd from offset with sendfile(), in order with the other
+    // sends. fd is duplicated, the caller may close it right away.
+    void send_file(int fd, off_t offset, size_t count) override;
     void close() override;
     void force_close() override;
 };
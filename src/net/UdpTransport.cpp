@@ -0,0 +1,291 @@
+#include "UdpTransport.h"
+#include <sys/socket.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+
+UdpTransport::Protocol UdpTransport::default_protocol = {};
+
+UdpTransport::UdpTransport(
+    EventLoop* loop,
+    Socket && socket,
+    Protocol* protocol,
+    const Options & options)
+    : Transport(loop, move(socket), &default_channel_protocol),
+      protocol(protocol),
+      options(options) {
+    if (!this->options.batch)
+        this->options.batch = 1;
+    size_t batch = this->options.batch;
+    size_t slot = this->options.gro ? 65536 : this->options.max_datagram;
+    slots.resize(batch * slot);
+    rmsgs.resize(batch);
+    riovs.resize(batch);
+    raddrs.resize(batch);
+    rcontrols.resize(batch * CMSG_SPACE(sizeof(int)));
+    for (size_t i = 0; i < batch; ++i) {
+        riovs[i] = {slots.data() + i * slot, slot};
+        rmsgs[i].msg_hdr.msg_iov = &riovs[i];
+        rmsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    smsgs.resize(batch);
+    siovs.resize(batch);
+    scontrols.resize(batch * CMSG_SPACE(sizeof(uint16_t)));
+}
+
+UdpTransport::UdpTransport(EventLoop* loop, Socket && socket, Protocol* protocol)
+    : UdpTransport(loop, move(socket), protocol, Options{}) {}
+
+UdpTransport::~UdpTransport() {
+    if (!closed()) {
+        set_state(DISCONNECTED);
+        channel.destroy();
+    }
+}
+
+bool UdpTransport::activate() {
+    loop->call_soon([this]() {
+        if (options.gro)
+            socket.setsockopt(SOL_UDP, UDP_GRO, 1);
+        resume_reading_for(0);
+        set_state(ACTIVATED);
+    });
+    return true;
+}
+
+void* UdpTransport::set_transport_protocol(void * protocol) {
+    void * prev_protocol = this->protocol;
+    this->protocol = static_cast<UdpTransport::Protocol*>(protocol);
+    return prev_protocol;
+}
+void* UdpTransport::get_transport_protocol() const {
+    return protocol;
+}
+
+void UdpTransport::handle_onread() {
+    loop->assert_within_self_thread();
+    size_t batch = options.batch;
+    size_t control = CMSG_SPACE(sizeof(int));
+    // edge triggered, read until the socket runs dry
+    while (!closed()) {
+        for (size_t i = 0; i < batch; ++i) {
+            auto & hdr = rmsgs[i].msg_hdr;
+            hdr.msg_name = &raddrs[i];
+            hdr.msg_namelen = sizeof(sockaddr_in6);
+            hdr.msg_control = options.gro ? rcontrols.data() + i * control : nullptr;
+            hdr.msg_controllen = options.gro ? control : 0;
+            hdr.msg_flags = 0;
+        }
+        int n = ::recvmmsg(socket.fd(), rmsgs.data(), batch, MSG_DONTWAIT, nullptr);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            int error = errno;
+            if (error == EINTR)
+                continue;
+            if (protocol->error_received_cb)
+                protocol->error_received_cb(*this, error);
+            // pending icmp errors are reported once, others end the read
+            if (error == ECONNREFUSED)
+                continue;
+            break;
+        }
+        received.clear();
+        size_t total = 0;
+        for (int i = 0; i < n; ++i) {
+            auto & hdr = rmsgs[i].msg_hdr;
+            const char * data = static_cast<const char*>(riovs[i].iov_base);
+            size_t len = min<size_t>(rmsgs[i].msg_len, riovs[i].iov_len);
+            InetAddr peer(raddrs[i]);
+            total += len;
+            size_t segment = len;
+            if (options.gro) {
+                for (cmsghdr * cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                        int size;
+                        ::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                        if (size > 0)
+                            segment = size;
+                    }
+                }
+            }
+            // a coalesced read is split back into the sent datagrams
+            for (size_t offset = 0; offset < len; offset += segment)
+                received.push_back({data + offset, min(segment, len - offset), peer});
+            if (!len)
+                received.push_back({data, 0, peer});
+        }
+        LoopMetrics::local().bytes_read.inc(total);
+        if (protocol->datagrams_received_cb)
+            protocol->datagrams_received_cb(*this, received.data(), received.size());
+        if (static_cast<size_t>(n) < batch)
+            break;
+    }
+}
+
+void UdpTransport::handle_onwrite() {
+    loop->assert_within_self_thread();
+    size_t control = CMSG_SPACE(sizeof(uint16_t));
+    int error = 0;
+    while (out_first < outgoing.size()) {
+        // one message per datagram, or per run of datagrams with gso
+        sends.clear();
+        size_t i = out_first, num = 0;
+        while (i < outgoing.size() && num < options.batch) {
+            auto & first = outgoing[i];
+            size_t j = i + 1, len = first.len;
+            if (options.gso && first.len) {
+                while (j < outgoing.size() && j - i < MAX_SEGMENTS
+                       && outgoing[j].peer == first.peer
+                       && outgoing[j].len && outgoing[j].len <= first.len
+                       && len + outgoing[j].len <= 65000) {
+                    len += outgoing[j].len;
+                    // only the last one may be shorter
+                    if (outgoing[j++].len < first.len)
+                        break;
+                }
+            }
+            auto & hdr = smsgs[num].msg_hdr;
+            hdr = {};
+            siovs[num] = {out.data() + first.offset, len};
+            hdr.msg_iov = &siovs[num];
+            hdr.msg_iovlen = 1;
+            if (first.peer.family()) {
+                hdr.msg_name = const_cast<sockaddr*>(first.peer.sockaddr());
+                hdr.msg_namelen = first.peer.sockaddrlen();
+            }
+            if (j - i > 1) {
+                char * buf = scontrols.data() + num * control;
+                ::memset(buf, 0, control);
+                hdr.msg_control = buf;
+                hdr.msg_controllen = control;
+                cmsghdr * cmsg = CMSG_FIRSTHDR(&hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment = static_cast<uint16_t>(first.len);
+                ::memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+            }
+            sends.push_back(j);
+            i = j;
+            num++;
+        }
+        int n = ::sendmmsg(socket.fd(), smsgs.data(), num, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                resume_writing();
+                break;
+            }
+            if (errno == EINTR)
+                continue;
+            // the first message failed, it's dropped
+            error = errno;
+            n = 1;
+        }
+        else {
+            size_t bytes = 0;
+            for (int k = 0; k < n; ++k)
+                bytes += siovs[k].iov_len;
+            LoopMetrics::local().bytes_written.inc(bytes);
+        }
+        out_first = sends[n - 1];
+    }
+    if (out_first == outgoing.size()) {
+        out.clear();
+        outgoing.clear();
+        out_first = 0;
+        pause_writing();
+    }
+    if (error && protocol->error_received_cb)
+        protocol->error_received_cb(*this, error);
+    if (!queued() && is_closing())
+        force_close();
+}
+
+void UdpTransport::handle_onclose() {
+    close();
+}
+
+void UdpTransport::handle_onerror() {
+    int error = socket.getsockerr();
+    if (error && protocol->error_received_cb)
+        protocol->error_received_cb(*this, error);
+}
+
+void UdpTransport::flush() {
+    dirty = false;
+    if (closed() || is_writing())
+        return;
+    handle_onwrite();
+}
+
+void UdpTransport::queue(const void* data, size_t len, const InetAddr & peer) {
+    if (state() == DISCONNECTING || closed())
+        return;
+    // the sent part is only dropped once needed
+    if (out.size() + len > options.max_queued_bytes && out_first) {
+        size_t sent = outgoing[out_first].offset;
+        out.erase(out.begin(), out.begin() + sent);
+        outgoing.erase(outgoing.begin(), outgoing.begin() + out_first);
+        out_first = 0;
+        for (auto & datagram : outgoing)
+            datagram.offset -= sent;
+    }
+    if (out.size() + len > options.max_queued_bytes) {
+        if (protocol->error_received_cb)
+            protocol->error_received_cb(*this, ENOBUFS);
+        return;
+    }
+    outgoing.push_back({out.size(), len, peer});
+    const char * bytes = static_cast<const char*>(data);
+    out.insert(out.end(), bytes, bytes + len);
+    schedule_flush();
+}
+
+void UdpTransport::send(const void* data, size_t len) {
+    send_to(data, len, InetAddr());
+}
+
+void UdpTransport::send_to(const void* data, size_t len, const InetAddr & peer) {
+    if (loop->within_self_thread()) {
+        queue(data, len, peer);
+        return;
+    }
+    // queued, the caller's buffer may be gone by the time the loop runs it
+    loop->call_soon([this, bytes = string(static_cast<const char*>(data), len), peer]() {
+        queue(bytes.data(), bytes.size(), peer);
+    });
+}
+
+void UdpTransport::send_file(int, off_t, size_t) {
+    loop->call_soon([this]() {
+        if (protocol->error_received_cb)
+            protocol->error_received_cb(*this, ENOTSUP);
+    });
+}
+
+void UdpTransport::close() {
+    if (is_closing() || closed())
+        return;
+    if (queued()) {
+        set_state(DISCONNECTING);
+        schedule_flush();
+    }
+    else {
+        force_close();
+    }
+}
+
+void UdpTransport::force_close() {
+    if (closed())
+        return;
+    set_state(DISCONNECTED);
+    channel.destroy();
+    out.clear();
+    outgoing.clear();
+    out_first = 0;
+    if (protocol->connection_lost_cb)
+        protocol->connection_lost_cb(*this);
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include "Transport.h"
+#include <netinet/udp.h>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+
+// A received datagram, data is only valid during the callback.
+struct Datagram {
+    const char * data;
+    size_t len;
+    InetAddr peer;
+};
+
+
+// Datagrams of a bound(or connected) udp socket on the loop's Channel.
+// Reads take up to Options::batch datagrams per recvmmsg() and hand them to
+// the protocol at once, sends are queued and written with sendmmsg() by the
+// loop's end of iteration flush.
+class UdpTransport : public Transport {
+public:
+    struct Options {
+        // datagrams per recvmmsg()/sendmmsg()
+        size_t batch = 64;
+        // larger datagrams are truncated
+        size_t max_datagram = 2048;
+        // UDP_SEGMENT: a run of equally sized datagrams to one peer(the last
+        // one may be shorter) is passed to the kernel as one
+        bool gso = false;
+        // UDP_GRO: the kernel passes coalesced datagrams which are split
+        // again before the callback. Every receiving slot takes 64KB then.
+        bool gro = false;
+        // bytes queued for sending, datagrams beyond are dropped and
+        // reported as ENOBUFS
+        size_t max_queued_bytes = 4 * 1024 * 1024;
+    };
+
+    struct Protocol {
+        function<void(UdpTransport&, const Datagram*, size_t)> datagrams_received_cb;
+        // errno of failed or dropped sends, or e.g. ECONNREFUSED of a
+        // connected socket
+        function<void(UdpTransport&, int)> error_received_cb;
+        TransportCallBack connection_lost_cb;
+    };
+    static Protocol default_protocol;
+    // datagrams within one GSO send
+    static const size_t MAX_SEGMENTS = 64;
+
+protected:
+    Protocol* protocol = nullptr;
+    Options options;
+
+    // receiving slots of options.batch datagrams, reused by every read
+    vector<char> slots;
+    vector<mmsghdr> rmsgs;
+    vector<iovec> riovs;
+    vector<sockaddr_in6> raddrs;
+    vector<char> rcontrols;
+    vector<Datagram> received;
+
+    // queued datagrams back to back, out_first is the first unsent one. An
+    // empty peer sends to the connected one.
+    struct Outgoing {
+        size_t offset, len;
+        InetAddr peer;
+    };
+    vector<char> out;
+    vector<Outgoing> outgoing;
+    size_t out_first = 0;
+    vector<mmsghdr> smsgs;
+    vector<iovec> siovs;
+    vector<char> scontrols;
+    vector<size_t> sends;
+
+    void queue(const void* data, size_t len, const InetAddr & peer);
+    void flush() override;
+    void handle_onread() override;
+    void handle_onwrite() override;
+    void handle_onclose() override;
+    void handle_onerror() override;
+
+public:
+    UdpTransport(EventLoop* loop, Socket && socket,
+                 Protocol* protocol, const Options & options);
+    UdpTransport(EventLoop* loop, Socket && socket,
+                 Protocol* protocol = &default_protocol);
+    ~UdpTransport() override;
+
+    bool activate() override;
+    void* set_transport_protocol(void * protocol) override;
+    void* get_transport_protocol() const override;
+    // to the connected peer
+    void send(const void* data, size_t len) override;
+    void send_to(const void* data, size_t len, const InetAddr & peer);
+    // not supported, reported as ENOTSUP
+    void send_file(int fd, off_t offset, size_t count) override;
+    // queued datagrams are sent first
+    void close() override;
+    void force_close() override;
+    // within the loop's thread
+    size_t queued() const {
+        return outgoing.size() - out_first;
+    }
+};
@@ -0,0 +1,155 @@
+#include "UnixTransport.h"
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+
+UnixTransport::UnixTransport(
+    EventLoop* loop,
+    Socket && socket,
+    chrono::seconds timeout,
+    Protocol* protocol,
+    Channel::Protocol* channel_protocol)
+    : TcpTransport(loop, move(socket), timeout, protocol, channel_protocol) {
+    int type = 0;
+    socklen_t len = sizeof(type);
+    if (::getsockopt(this->socket.fd(), SOL_SOCKET, SO_TYPE, &type, &len) == 0)
+        seqpacket = type == SOCK_SEQPACKET;
+}
+
+UnixTransport::~UnixTransport() {
+    for (int fd : fds_received)
+        ::close(fd);
+    for (auto & message : messages) {
+        for (int fd : message.fds)
+            ::close(fd);
+    }
+}
+
+ssize_t UnixTransport::read_socket() {
+    if (seqpacket)
+        return rbuffer.feed_rbuffer(socket.fd(), &fds_received, MAX_MESSAGE,
+                                    &sizes_received, read_budget);
+    return rbuffer.feed_rbuffer(socket.fd(), &fds_received, 0, nullptr, read_budget);
+}
+
+void UnixTransport::queue_message(const void* data, size_t len, vector<int> fds) {
+    if (closed() || is_closing()) {
+        for (int fd : fds)
+            ::close(fd);
+        return;
+    }
+    reset_timeout();
+    messages.push_back({static_cast<size_t>(wbuffer.size()), len, move(fds)});
+    wbuffer.feed_wbuffer(data, len);
+    schedule_flush();
+    check_watermarks();
+}
+
+void UnixTransport::send(const void* data, size_t len) {
+    if (!seqpacket) {
+        TcpTransport::send(data, len);
+        return;
+    }
+    if (!len)
+        return;
+    if (get_event_loop()->within_self_thread()) {
+        queue_message(data, len, {});
+        return;
+    }
+    run_in_loop([this, bytes = string(static_cast<const char*>(data), len)]() {
+        queue_message(bytes.data(), bytes.size(), {});
+    });
+}
+
+void UnixTransport::send_fds(const int * fds, size_t num, const void* data, size_t len) {
+    if (!len) {
+        LOG(ERROR) << "Passing fds needs data to carry them, fd " << socket.fd();
+        return;
+    }
+    // the caller keeps its own fds, these are closed once sent
+    vector<int> dups;
+    for (size_t i = 0; i < num; ++i) {
+        int fd = ::fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+        if (fd < 0)
+            LOG(ERROR) << "Duplicating fd " << fds[i] << " failed, errno " << errno;
+        else
+            dups.push_back(fd);
+    }
+    if (get_event_loop()->within_self_thread()) {
+        queue_message(data, len, move(dups));
+        return;
+    }
+    run_in_loop([this, bytes = string(static_cast<const char*>(data), len),
+                 dups = move(dups)]() mutable {
+        queue_message(bytes.data(), bytes.size(), move(dups));
+    });
+}
+
+vector<int> UnixTransport::take_fds() {
+    vector<int> fds;
+    swap(fds, fds_received);
+    return fds;
+}
+
+void UnixTransport::written(size_t bytes) {
+    // the front one is either written itself or what's ahead of it
+    for (size_t i = messages.front().ahead ? 0 : 1; i < messages.size(); ++i)
+        messages[i].ahead -= bytes;
+}
+
+void UnixTransport::handle_onwrite() {
+    loop->assert_within_self_thread();
+    while (!messages.empty()) {
+        auto & message = messages.front();
+        bool passing = !message.ahead && !message.fds.empty();
+        size_t fds_size = sizeof(int) * message.fds.size();
+        vector<char> control(passing ? CMSG_SPACE(fds_size) : 0);
+        if (passing) {
+            msghdr msg {};
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(fds_size);
+            ::memcpy(CMSG_DATA(cmsg), message.fds.data(), fds_size);
+        }
+        size_t before = wbuffer.size();
+        ssize_t res = wbuffer.send_wbuffer(socket.fd(), 0,
+                                           message.ahead ? message.ahead : message.len,
+                                           passing ? control.data() : nullptr,
+                                           control.size());
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                resume_writing();
+            else
+                force_close();
+            return;
+        }
+        size_t bytes = before - wbuffer.size();
+        bool plain = message.ahead;
+        written(bytes);
+        if (plain) {
+            if (message.ahead) {
+                resume_writing();
+                return;
+            }
+            continue;
+        }
+        // the fds went out with the first byte, the rest is plain data
+        for (int fd : message.fds)
+            ::close(fd);
+        bool whole = bytes == message.len;
+        messages.pop_front();
+        if (!whole) {
+            resume_writing();
+            return;
+        }
+    }
+    TcpTransport::handle_onwrite();
+}
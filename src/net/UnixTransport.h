@@ -0,0 +1,56 @@
+#pragma once
+#include "Transport.h"
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+
+// TcpTransport over an AF_UNIX stream or seqpacket socket, passing fds
+// (SCM_RIGHTS) in order with the data sent. TcpServer and TcpClient create
+// them for unix domain addresses, see InetAddr::unix_path().
+// Seqpacket sockets keep the boundaries: every send() is one message and the
+// sizes of the messages received are queued in message_sizes().
+class UnixTransport : public TcpTransport {
+public:
+    // receiving room of seqpacket sockets, larger messages are truncated
+    static const size_t MAX_MESSAGE = 64 * 1024;
+
+protected:
+    // sent on its own once the ahead bytes queued before it are written
+    struct Message {
+        size_t ahead, len;
+        vector<int> fds;
+    };
+    deque<Message> messages;
+    vector<int> fds_received;
+    deque<size_t> sizes_received;
+    bool seqpacket = false;
+
+    void queue_message(const void* data, size_t len, vector<int> fds);
+    void written(size_t bytes);
+    ssize_t read_socket() override;
+    void handle_onwrite() override;
+
+public:
+    UnixTransport(EventLoop* loop, Socket && socket, chrono::seconds timeout,
+                  Protocol* protocol, Channel::Protocol* channel_protocol);
+    ~UnixTransport() override;
+
+    bool is_seqpacket() const {
+        return seqpacket;
+    }
+    void send(const void* data, size_t len) override;
+    // num fds are duplicated and passed along with data, which must not be
+    // empty. The order with the other sends is kept, files of send_file()
+    // are only ordered with plain sends.
+    void send_fds(const int * fds, size_t num, const void* data, size_t len);
+    // within the loop's thread, e.g. from data_received_cb. The fds received
+    // so far, the caller owns them from now on.
+    vector<int> take_fds();
+    // seqpacket only, the sizes of the messages in rbuffer in order. Pop
+    // them while draining rbuffer.
+    deque<size_t>& message_sizes() {
+        return sizes_received;
+    }
+};
@@ -34,8 +34,15 @@ private:
 
     States _state = States::NEW;
     int _events = 0, _prev_events = 0;
+    bool edge = true;
 
     Protocol* protocol;
+    // set while dispatching, callbacks are allowed to destroy the channel
+    bool * destroyed_flag = nullptr;
+
+    int mode() const {
+        return edge ? _events | Selector::EDGE : _events;
+    }
 public:
     using CallBack = Protocol::CallBack;
 
@@ -45,6 +52,8 @@ public:
           protocol(protocol) {}
 
     ~Channel() {
+        if (destroyed_flag)
+            *destroyed_flag = true;
         destroy();
     }
     int fd() const { return _fd; }
@@ -53,6 +62,7 @@ public:
     operator bool() const { return _events != 0; }
     bool is_writing() const { return _events & WRITE; }
     bool is_reading() const { return _events & READ; }
+    bool is_edge_triggered() const { return edge; }
 
 
     void enable(int evs) {
@@ -78,6 +88,16 @@ public:
     void remove() {
         disable_all();
     }
+    // edge triggered(the default) channels are reported once they become
+    // ready and must be read until EAGAIN, level triggered ones as long as
+    // they are ready.
+    void set_edge_triggered(bool edge) {
+        if (this->edge != edge) {
+            this->edge = edge;
+            if (_state == States::ADDED)
+                notify();
+        }
+    }
 
     void destroy() {
         if (_state != States::DESTROYED) {
@@ -86,17 +106,31 @@ public:
         }
     }
 
+    // leaves the selector keeping the events, the next notify() registers
+    // them with the new one, e.g. once moved to another loop's thread
+    void move_to(Selector* selector) {
+        if (_state == States::DESTROYED)
+            return;
+        if (_state == States::ADDED)
+            this->selector->remove(_fd);
+        this->selector = selector;
+        _state = States::NEW;
+    }
+
     void notify() {
         if (_state == States::DESTROYED)
             return;
         if (_state == States::NEW || _state == States::DELETED) {
+            // nothing to watch, e.g. destroyed before ever enabled
+            if (!*this)
+                return;
             _state = States::ADDED;
-            selector->add(_fd, _events, this);
+            selector->add(_fd, mode(), this);
         }
         else {
             assert(_state == States::ADDED);
             if (*this) {
-                selector->modify(_fd, _events, this);
+                selector->modify(_fd, mode(), this);
             }
             else {
                 selector->remove(_fd);
@@ -106,20 +140,28 @@ public:
     }
 
     void handle_events(int newevents) {
-        if (_state == States::DESTROYED)
+        // events of the same select() after it was removed
+        if (_state != States::ADDED)
             return;
+        bool destroyed = false;
+        destroyed_flag = &destroyed;
         if ((newevents & POLLHUP) && !(newevents & POLLIN)) {
             if (protocol->close_cb) protocol->close_cb(controller);
+            if (destroyed) return;
         }
         if (newevents & (POLLNVAL | POLLERR)) {
             if (protocol->error_cb) protocol->error_cb(controller);
+            if (destroyed) return;
         }
         if (newevents & ((POLLIN | POLLPRI) | POLLRDHUP)) {
             if (protocol->read_cb) protocol->read_cb(controller);
+            if (destroyed) return;
         }
         if (newevents & POLLOUT) {
             if (protocol->write_cb) protocol->write_cb(controller);
+            if (destroyed) return;
         }
+        destroyed_flag = nullptr;
         _prev_events = newevents;
     }
 };
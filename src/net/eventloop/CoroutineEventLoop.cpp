@@ -0,0 +1,192 @@
+#include "CoroutineEventLoop.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+using namespace std;
+
+
+/*******************************FrameAllocator*******************************/
+
+FrameAllocator::~FrameAllocator() {
+    for (auto & head : free_lists) {
+        while (head) {
+            ::operator delete(exchange(head, head->next));
+        }
+    }
+}
+
+FrameAllocator& FrameAllocator::local() {
+    static thread_local FrameAllocator allocator;
+    return allocator;
+}
+
+void* FrameAllocator::allocate(size_t size) {
+    size_t index = (size + ALIGN - 1) / ALIGN - 1;
+    if (index >= NUM_CLASSES)
+        return ::operator new(size);
+    if (FreeNode * node = free_lists[index]) {
+        free_lists[index] = node->next;
+        return node;
+    }
+    return ::operator new((index + 1) * ALIGN);
+}
+
+void FrameAllocator::deallocate(void * ptr, size_t size) {
+    size_t index = (size + ALIGN - 1) / ALIGN - 1;
+    if (index >= NUM_CLASSES) {
+        ::operator delete(ptr);
+        return;
+    }
+    auto node = static_cast<FreeNode*>(ptr);
+    node->next = free_lists[index];
+    free_lists[index] = node;
+}
+
+/*********************************AsyncSocket*********************************/
+
+Channel::Protocol AsyncSocket::channel_protocol = {
+    [](void * pthis) {
+        static_cast<AsyncSocket*>(pthis)->handle_readable();
+    },
+    [](void * pthis) {
+        static_cast<AsyncSocket*>(pthis)->handle_writable();
+    },
+    [](void * pthis) {
+        static_cast<AsyncSocket*>(pthis)->handle_error();
+    },
+    [](void * pthis) {
+        static_cast<AsyncSocket*>(pthis)->handle_error();
+    }
+};
+
+AsyncSocket::AsyncSocket(EventLoop * loop, Socket && socket)
+    : loop(loop),
+      socket(move(socket)),
+      channel(this->socket.fd(), this, loop->selector.get(), &channel_protocol) {}
+
+AsyncSocket::~AsyncSocket() {
+    channel.destroy();
+}
+
+void AsyncSocket::register_channel() {
+    // edge triggered, registering both directions once is enough
+    if (!channel)
+        channel.enable(Channel::READ | Channel::WRITE);
+}
+
+AsyncSocket::ReadyAwaiter AsyncSocket::readable() {
+    register_channel();
+    return ReadyAwaiter{reader};
+}
+
+AsyncSocket::ReadyAwaiter AsyncSocket::writable() {
+    register_channel();
+    return ReadyAwaiter{writer};
+}
+
+void AsyncSocket::handle_readable() {
+    if (reader)
+        exchange(reader, {}).resume();
+}
+
+void AsyncSocket::handle_writable() {
+    if (writer)
+        exchange(writer, {}).resume();
+}
+
+void AsyncSocket::handle_error() {
+    // waiters retry their syscall and see the error themselves
+    auto w = exchange(writer, {});
+    handle_readable();
+    if (w)
+        w.resume();
+}
+
+int AsyncSocket::fd() const {
+    return socket.fd();
+}
+
+Socket& AsyncSocket::get_socket() {
+    return socket;
+}
+
+EventLoop* AsyncSocket::get_event_loop() const {
+    return loop;
+}
+
+void AsyncSocket::close() {
+    channel.destroy();
+    socket.close();
+}
+
+/*******************************AsyncConnection*******************************/
+
+AsyncConnection::AsyncConnection(EventLoop * loop, Socket && socket)
+    : AsyncSocket(loop, move(socket)) {}
+
+Task<ssize_t> AsyncConnection::read_some() {
+    while (true) {
+        ssize_t nbytes = rbuffer.feed_rbuffer(socket.fd());
+        if (nbytes >= 0 || (errno != EAGAIN && errno != EINTR))
+            co_return nbytes;
+        co_await readable();
+    }
+}
+
+Task<ssize_t> AsyncConnection::read_some(void * data, size_t len) {
+    while (true) {
+        ssize_t nbytes = ::read(socket.fd(), data, len);
+        if (nbytes > 0)
+            LoopMetrics::local().bytes_read.inc(nbytes);
+        if (nbytes >= 0 || (errno != EAGAIN && errno != EINTR))
+            co_return nbytes;
+        co_await readable();
+    }
+}
+
+Task<ssize_t> AsyncConnection::write(const void * data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t nbytes = ::send(socket.fd(),
+                                static_cast<const char*>(data) + written,
+                                len - written, MSG_NOSIGNAL);
+        if (nbytes >= 0) {
+            written += nbytes;
+            LoopMetrics::local().bytes_written.inc(nbytes);
+        }
+        else if (errno == EAGAIN || errno == EINTR) {
+            co_await writable();
+        }
+        else {
+            co_return -1;
+        }
+    }
+    co_return static_cast<ssize_t>(written);
+}
+
+int AsyncConnection::shutdown(int op) {
+    return socket.shutdown(op);
+}
+
+/*********************************AsyncServer*********************************/
+
+AsyncServer::AsyncServer(EventLoop * loop, const InetAddr & addr)
+    : AsyncSocket(loop, Socket::server_socket(addr)) {
+    socket.listen();
+}
+
+AsyncServer::AsyncServer(EventLoop * loop, Socket && listening)
+    : AsyncSocket(loop, move(listening)) {}
+
+Task<Socket> AsyncServer::accept() {
+    while (true) {
+        Socket sock = socket.accept();
+        if (sock.fd() >= 0)
+            co_return move(sock);
+        if (errno == EAGAIN)
+            co_await readable();
+        else if (errno != EINTR && errno != ECONNABORTED)
+            co_return move(sock);
+    }
+}
@@ -0,0 +1,249 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <string_view>
+#include <chrono>
+#include "ThreadingEventLoop.h"
+#include "Channel.h"
+#include "../Socket.h"
+#include "../Buffer.h"
+#include "../../utils/Common.h"
+
+using namespace std;
+using namespace chrono;
+
+
+// Coroutine frames are recycled through size classed free lists. Every loop
+// runs in its own thread, so a thread local allocator is a per loop allocator
+// and needs no synchronization.
+class FrameAllocator : public NoCopyble {
+private:
+    static constexpr size_t ALIGN = 64, NUM_CLASSES = 32;
+    struct FreeNode {
+        FreeNode * next;
+    };
+    FreeNode * free_lists[NUM_CLASSES] {};
+
+public:
+    FrameAllocator() = default;
+    ~FrameAllocator();
+    static FrameAllocator& local();
+
+    void* allocate(size_t size);
+    void deallocate(void * ptr, size_t size);
+};
+
+
+template <typename T>
+class Task;
+
+class PromiseBase {
+public:
+    coroutine_handle<> continuation;
+    exception_ptr exception;
+    bool detached = false;
+
+    static void* operator new(size_t size) {
+        return FrameAllocator::local().allocate(size);
+    }
+    static void operator delete(void * ptr, size_t size) {
+        FrameAllocator::local().deallocate(ptr, size);
+    }
+
+    // transfer to the awaiting coroutine without growing the stack
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename Promise>
+        coroutine_handle<> await_suspend(coroutine_handle<Promise> h) noexcept {
+            auto & promise = h.promise();
+            if (promise.continuation)
+                return promise.continuation;
+            if (promise.detached)
+                h.destroy();
+            return noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() {
+        if (detached)
+            terminate();
+        exception = current_exception();
+    }
+};
+
+template <typename T>
+class TaskPromise : public PromiseBase {
+public:
+    optional<T> value;
+
+    Task<T> get_return_object();
+    template <typename U>
+    void return_value(U && val) {
+        value.emplace(forward<U>(val));
+    }
+    T result() {
+        if (exception)
+            rethrow_exception(exception);
+        return move(*value);
+    }
+};
+
+template <>
+class TaskPromise<void> : public PromiseBase {
+public:
+    Task<void> get_return_object();
+    void return_void() const noexcept {}
+    void result() {
+        if (exception)
+            rethrow_exception(exception);
+    }
+};
+
+
+// Lazily started coroutine, runs when awaited or spawned on a loop.
+template <typename T = void>
+class [[nodiscard]] Task : public NoCopyble {
+public:
+    using promise_type = TaskPromise<T>;
+    using handle_type = coroutine_handle<promise_type>;
+
+private:
+    handle_type handle;
+
+public:
+    explicit Task(handle_type handle) : handle(handle) {}
+    Task(Task && other) noexcept : handle(exchange(other.handle, {})) {}
+    ~Task() {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept {
+        return !handle || handle.done();
+    }
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() {
+        return handle.promise().result();
+    }
+
+    handle_type release() {
+        return exchange(handle, {});
+    }
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>{coroutine_handle<TaskPromise<T>>::from_promise(*this)};
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>{coroutine_handle<TaskPromise<void>>::from_promise(*this)};
+}
+
+// Start a task on the loop, the frame is freed when the task finishes.
+inline void co_spawn(EventLoop * loop, Task<void> && task) {
+    auto handle = task.release();
+    handle.promise().detached = true;
+    loop->call_soon([handle]() { handle.resume(); });
+}
+
+
+class SleepAwaiter {
+private:
+    EventLoop * loop;
+    microseconds delay;
+public:
+    SleepAwaiter(EventLoop * loop, const microseconds & delay)
+        : loop(loop), delay(delay) {}
+
+    bool await_ready() const noexcept {
+        return delay <= 0us;
+    }
+    void await_suspend(coroutine_handle<> h) {
+        loop->call_later([h]() { h.resume(); }, delay);
+    }
+    void await_resume() const noexcept {}
+};
+
+// the awaiting coroutine must stay alive until the timer fires.
+inline SleepAwaiter sleep_for(const microseconds & delay,
+                              EventLoop * loop = EventLoop::current()) {
+    return {loop, delay};
+}
+
+
+// Socket driven by coroutines. Syscalls are tried first, the coroutine only
+// suspends on EAGAIN and readiness events resume it directly from the channel
+// callback. All operations must happen within the loop's thread.
+class AsyncSocket : public NoCopyble {
+protected:
+    EventLoop * loop;
+    Socket socket;
+    Channel channel;
+    coroutine_handle<> reader, writer;
+
+    class ReadyAwaiter {
+    private:
+        coroutine_handle<> & waiter;
+    public:
+        explicit ReadyAwaiter(coroutine_handle<> & waiter) : waiter(waiter) {}
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> h) noexcept { waiter = h; }
+        void await_resume() const noexcept {}
+    };
+
+    void register_channel();
+    ReadyAwaiter readable();
+    ReadyAwaiter writable();
+    void handle_readable();
+    void handle_writable();
+    void handle_error();
+
+public:
+    static Channel::Protocol channel_protocol;
+
+    AsyncSocket(EventLoop * loop, Socket && socket);
+    ~AsyncSocket();
+
+    int fd() const;
+    Socket& get_socket();
+    EventLoop* get_event_loop() const;
+    void close();
+};
+
+
+class AsyncConnection : public AsyncSocket {
+public:
+    Buffer rbuffer;
+
+    AsyncConnection(EventLoop * loop, Socket && socket);
+
+    // read what is available into rbuffer, returns the number of bytes read,
+    // 0 on eof and -1 on error.
+    Task<ssize_t> read_some();
+    Task<ssize_t> read_some(void * data, size_t len);
+    // returns when all bytes are written, -1 on error.
+    Task<ssize_t> write(const void * data, size_t len);
+    Task<ssize_t> write(string_view data) {
+        return write(data.data(), data.size());
+    }
+    int shutdown(int op = SHUT_WR);
+};
+
+
+class AsyncServer : public AsyncSocket {
+public:
+    AsyncServer(EventLoop * loop, const InetAddr & addr);
+    AsyncServer(EventLoop * loop, Socket && listening);
+
+    // returns a socket with negative fd on error, errno is kept.
+    Task<Socket> accept();
+};
@@ -0,0 +1,132 @@
+#pragma once
+#include "ThreadingEventLoop.h"
+#include "SpscQueue.h"
+#include "../../utils/Common.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+
+using namespace std;
+
+
+// Typed loop-to-loop messaging for the loops of a ThreadingEventLoop. Every
+// ordered pair of loops owns a bounded spsc ring, so senders never contend
+// and messages are passed by value without allocating a task per message.
+// Each loop drains its incoming rings in batches once per iteration, and a
+// destination is woken up at most once until it has polled again, however
+// many messages are sent to it meanwhile.
+template <typename T>
+class LoopMesh : public NoCopyble {
+public:
+    // runs within the destination loop
+    using Handler = function<void(EventLoop * loop, int from, T && msg)>;
+
+private:
+    struct alignas(SpscQueue<T>::CACHELINE) Inbox {
+        atomic<bool> notified {false};
+    };
+
+    // shared with the pollers, which are removed from their loops shortly
+    // after the mesh handle is gone
+    struct State {
+        vector<EventLoop *> loops;
+        Handler handler;
+        size_t batch;
+        // rings[from * n + to]
+        vector<unique_ptr<SpscQueue<T>>> rings;
+        unique_ptr<Inbox[]> inboxes;
+        // poller of each loop, only touched within that loop
+        vector<int> pollers;
+        // set by the mesh's destructor, pollers not added yet never will be
+        atomic<bool> stopped {false};
+
+        size_t size() const {
+            return loops.size();
+        }
+
+        bool send(int from, int to, T && msg) {
+            if (!rings[from * size() + to]->push(move(msg)))
+                return false;
+            // a poll clears the flag before draining, either it sees this
+            // message or the flag is cleared and the next sender wakes it up.
+            if (from != to && !inboxes[to].notified.exchange(true, memory_order_acq_rel))
+                loops[to]->wakeup();
+            return true;
+        }
+
+        bool poll(int to) {
+            inboxes[to].notified.exchange(false, memory_order_acq_rel);
+            EventLoop * loop = loops[to];
+            bool pending = false;
+            for (size_t from = 0; from < size(); ++from) {
+                auto & ring = *rings[from * size() + to];
+                size_t n = ring.consume([&](T && msg) {
+                    handler(loop, from, move(msg));
+                }, batch);
+                if (n == batch && !ring.empty())
+                    pending = true;
+            }
+            return pending;
+        }
+    };
+
+    shared_ptr<State> state;
+
+public:
+    // capacity is per ring, batch bounds the messages taken from one ring
+    // per iteration so that a busy sender can not starve the loop.
+    LoopMesh(ThreadingEventLoop & pool, Handler handler,
+             size_t capacity = 1024, size_t batch = 64)
+        : state(make_shared<State>()) {
+        state->loops = pool.loops();
+        state->handler = move(handler);
+        state->batch = batch > 0 ? batch : 1;
+        size_t n = state->size();
+        for (size_t i = 0; i < n * n; ++i) {
+            state->rings.emplace_back(new SpscQueue<T>(capacity));
+        }
+        state->inboxes.reset(new Inbox[n]);
+        state->pollers.assign(n, -1);
+        for (size_t i = 0; i < n; ++i) {
+            EventLoop * loop = state->loops[i];
+            loop->call_soon([loop, i, st = state]() {
+                if (st->stopped.load(memory_order_acquire))
+                    return;
+                st->pollers[i] = loop->add_poller([i, st]() { return st->poll(i); });
+            });
+        }
+    }
+
+    // before the pool's loops are closed. Messages still queued are dropped,
+    // the handler is not called anymore once each loop has run its removal.
+    ~LoopMesh() {
+        state->stopped.store(true, memory_order_release);
+        for (size_t i = 0; i < state->size(); ++i) {
+            EventLoop * loop = state->loops[i];
+            loop->call_soon([loop, i, st = state]() {
+                if (st->pollers[i] >= 0)
+                    loop->remove_poller(st->pollers[i]);
+                st->pollers[i] = -1;
+            });
+        }
+    }
+
+    int size() const {
+        return state->size();
+    }
+
+    // within the thread of loop `from`, returns false when the ring to the
+    // destination is full and the message was not sent.
+    bool send(int from, int to, T msg) {
+        return state->send(from, to, move(msg));
+    }
+
+    // within a loop of the pool
+    bool send(int to, T msg) {
+        EventLoop * loop = EventLoop::current();
+        if (!loop || loop->index() >= size() || state->loops[loop->index()] != loop)
+            return false;
+        return state->send(loop->index(), to, move(msg));
+    }
+};
@@ -0,0 +1,67 @@
+#include "MemoryBudget.h"
+
+using namespace std;
+
+
+MemoryBudget::MemoryBudget(size_t limit, size_t num_loops)
+    : _limit(static_cast<int64_t>(limit)),
+      shards(new Shard[num_loops > 0 ? num_loops : 1]),
+      num_shards(num_loops > 0 ? num_loops : 1) {}
+
+void MemoryBudget::reconcile(int index, int64_t local_bytes) {
+    auto & shard = shards[index % num_shards];
+    if (local_bytes != shard.published) {
+        _used.fetch_add(local_bytes - shard.published, memory_order_relaxed);
+        shard.published = local_bytes;
+    }
+    int64_t total = used();
+    if (!shard.pressure && total >= _limit * high) {
+        shard.pressure = true;
+    }
+    else if (shard.pressure && total <= _limit * low) {
+        shard.pressure = false;
+        // resumed reads may pause again, into a fresh list
+        auto resumes = move(shard.paused);
+        shard.paused.clear();
+        for (auto & resume : resumes)
+            resume();
+    }
+}
+
+bool MemoryBudget::under_pressure(int index) const {
+    return shards[index % num_shards].pressure;
+}
+
+bool MemoryBudget::admit(int index) {
+    auto & shard = shards[index % num_shards];
+    if (!shard.pressure)
+        return true;
+    shard.rejected_accepts.inc();
+    return false;
+}
+
+bool MemoryBudget::should_pause(int index, size_t buffered) const {
+    auto & shard = shards[index % num_shards];
+    return shard.pressure && (buffered >= large_consumer || used() >= _limit);
+}
+
+void MemoryBudget::paused(int index, function<void()> resume) {
+    auto & shard = shards[index % num_shards];
+    shard.paused.push_back(move(resume));
+    shard.paused_reads.inc();
+}
+
+void MemoryBudget::collect(MetricsSnapshot & snapshot) const {
+    Gauge limit, used;
+    limit.set(_limit);
+    used.set(this->used());
+    snapshot.add("netyo_memory_budget_bytes", "buffer memory limit", limit);
+    snapshot.add("netyo_memory_used_bytes", "buffer memory reconciled over all loops", used);
+    for (size_t i = 0; i < num_shards; ++i) {
+        snapshot.add("netyo_memory_rejected_accepts_total",
+                     "connections rejected under memory pressure",
+                     shards[i].rejected_accepts);
+        snapshot.add("netyo_memory_paused_reads_total",
+                     "reads paused under memory pressure", shards[i].paused_reads);
+    }
+}
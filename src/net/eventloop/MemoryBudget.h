@@ -0,0 +1,58 @@
+#pragma once
+#include "../../utils/Common.h"
+#include "../../utils/Metrics.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+
+// Buffer memory of all the loops of a ThreadingEventLoop against one limit.
+// Every loop accounts its buffers locally(LoopMetrics::buffer_bytes) and
+// publishes the difference to the shared total once per reconcile() only.
+// Above high * limit a loop is under pressure: it rejects new connections
+// and stops reading from connections holding more than large_consumer bytes,
+// or from any connection once the limit itself is reached. Writes are never
+// held back, so buffers are flushed. Below low * limit the paused reads are
+// resumed.
+class MemoryBudget : public NoCopyble {
+private:
+    // only touched within the owning loop, except for the metrics
+    struct alignas(64) Shard {
+        int64_t published = 0;
+        bool pressure = false;
+        vector<function<void()>> paused;
+        Counter rejected_accepts, paused_reads;
+    };
+    const int64_t _limit;
+    atomic<int64_t> _used {0};
+    unique_ptr<Shard[]> shards;
+    size_t num_shards;
+
+public:
+    double high = 0.8, low = 0.6;
+    size_t large_consumer = 256 * 1024;
+
+    MemoryBudget(size_t limit, size_t num_loops);
+
+    size_t limit() const { return _limit; }
+    // as of the last reconciliation of every loop
+    int64_t used() const { return _used.load(memory_order_relaxed); }
+
+    // within loop index's thread, periodically, local_bytes being the
+    // buffer bytes accounted by the loop
+    void reconcile(int index, int64_t local_bytes);
+    bool under_pressure(int index) const;
+    // false and counted as rejected if new connections are not admitted
+    bool admit(int index);
+    // whether a connection holding buffered bytes should stop reading
+    bool should_pause(int index, size_t buffered) const;
+    // resume runs within the loop once the pressure is relieved
+    void paused(int index, function<void()> resume);
+
+    // safe to call from any thread
+    void collect(MetricsSnapshot & snapshot) const;
+};
@@ -18,6 +18,7 @@
 
 #include <atomic>
 #include <memory>
+#include <new>
 #include <type_traits>
 
 /// A lock-free multiple producers single consumer queue
@@ -36,7 +37,8 @@ public:
     }
     template <typename X>
     void enqueue(X &&input) {
-        BufferNode *node{new BufferNode(std::forward<X>(input))};
+        BufferNode *node{new BufferNode};
+        node->construct(std::forward<X>(input));
         BufferNode *prevhead{head_.exchange(node, std::memory_order_acq_rel)};
         prevhead->next_.store(node, std::memory_order_release);
     }
@@ -48,20 +50,30 @@ public:
         if (next == nullptr) {
             return false;
         }
-        output = std::move(*(next->dataPtr_));
-        delete next->dataPtr_;
+        output = std::move(next->value());
+        // next becomes the new dummy node
+        next->destroy();
         tail_.store(next, std::memory_order_release);
         delete tail;
         return true;
     }
 
 private:
+    // the value is kept within the node, one allocation per element
     struct BufferNode {
-        BufferNode() = default;
-        BufferNode(const T &data) : dataPtr_(new T(data)) {}
-        BufferNode(T &&data) : dataPtr_(new T(std::move(data))) {}
-        T *dataPtr_;
+        alignas(T) unsigned char data_[sizeof(T)];
         std::atomic<BufferNode *> next_{nullptr};
+
+        template <typename X>
+        void construct(X &&input) {
+            new (data_) T(std::forward<X>(input));
+        }
+        T &value() {
+            return *std::launder(reinterpret_cast<T *>(data_));
+        }
+        void destroy() {
+            value().~T();
+        }
     };
 
     std::atomic<BufferNode *> head_;
@@ -0,0 +1,98 @@
+#pragma once
+#include "../../utils/Common.h"
+#include <atomic>
+#include <vector>
+#include <utility>
+
+using namespace std;
+
+
+// A bounded lock-free single producer single consumer ring. The indices owned
+// by each side live in their own cache line together with a cached copy of
+// the other side's index, so the shared lines are only touched when the
+// cached view runs out.
+template <typename T>
+class SpscQueue : public NoCopyble {
+public:
+    static constexpr size_t CACHELINE = 64;
+
+private:
+    const size_t mask;
+    vector<T> slots;
+
+    // consumer side
+    alignas(CACHELINE) atomic<size_t> head {0};
+    size_t cached_tail = 0;
+
+    // producer side
+    alignas(CACHELINE) atomic<size_t> tail {0};
+    size_t cached_head = 0;
+
+    static size_t round_up(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        return n;
+    }
+
+public:
+    // the capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity = 1024)
+        : mask(round_up(capacity) - 1), slots(mask + 1) {}
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+    // producer only, returns false when the ring is full
+    template <typename X>
+    bool push(X && value) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - cached_head > mask) {
+            cached_head = head.load(memory_order_acquire);
+            if (t - cached_head > mask)
+                return false;
+        }
+        slots[t & mask] = forward<X>(value);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    // consumer only
+    bool pop(T & output) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == cached_tail) {
+            cached_tail = tail.load(memory_order_acquire);
+            if (h == cached_tail)
+                return false;
+        }
+        output = move(slots[h & mask]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // consumer only, hands at most max_items to f(T&&) and releases their
+    // slots with a single store, returns the number of items consumed.
+    template <typename F>
+    size_t consume(F && f, size_t max_items) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == cached_tail)
+            cached_tail = tail.load(memory_order_acquire);
+        size_t n = cached_tail - h;
+        if (n > max_items)
+            n = max_items;
+        for (size_t i = 0; i < n; ++i) {
+            f(move(slots[(h + i) & mask]));
+        }
+        head.store(h + n, memory_order_release);
+        return n;
+    }
+
+    // consumer only
+    bool empty() {
+        if (head.load(memory_order_relaxed) != cached_tail)
+            return false;
+        cached_tail = tail.load(memory_order_acquire);
+        return head.load(memory_order_relaxed) == cached_tail;
+    }
+};
@@ -1,4 +1,7 @@
 #include "TaskQueue.h"
+#include "../../utils/Logging.h"
+#include "../../utils/Trace.h"
+#include <errno.h>
 
 Channel::Protocol TaskQueue::channel_protocol = {
     [](void * pthis) {
@@ -23,23 +26,43 @@ TaskQueue::~TaskQueue() {
 
 void TaskQueue::handle_wakeup() {
     read_event_fd(wakeup_fd);
-    CallBack func;
-    while (tasks.dequeue(func)) {
-        func();
+    QueuedTask task;
+    size_t num_tasks = 0;
+    // at most one clock read per batch, later tasks of the batch are
+    // undercounted by the time the earlier ones ran.
+    chrono::steady_clock::time_point start;
+    auto & task_delay = LoopMetrics::local().task_delay;
+    while (tasks.dequeue(task)) {
+        // only sampled tasks are stamped
+        if (task.first.time_since_epoch().count()) {
+            if (!start.time_since_epoch().count())
+                start = chrono::steady_clock::now();
+            auto delay = chrono::duration_cast<chrono::nanoseconds>(start - task.first);
+            task_delay.record(delay.count() > 0 ? delay.count() : 0);
+        }
+        task.second();
+        TRACE(complete(TraceType::TASK, 0));
+        num_tasks++;
     }
+    num_pending.fetch_sub(num_tasks, memory_order_relaxed);
+    LoopMetrics::local().tasks_run.inc(num_tasks);
 }
 
-TaskQueue::CallBack && TaskQueue::pop() {
+size_t TaskQueue::size() const {
+    return num_pending.load(memory_order_relaxed);
+}
+
+TaskQueue::CallBack TaskQueue::pop() {
     // no need to use call_soon, the mpsc queue can ensures no conficts
-    CallBack func;
-    tasks.dequeue(func);
-    return move(func);
+    QueuedTask task;
+    tasks.dequeue(task);
+    return move(task.second);
 }
 
 int TaskQueue::create_event_fd() {
     int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     if (event_fd < 0) {
-        // error
+        LOG(FATAL) << "eventfd failed, errno " << errno;
     }
     return event_fd;
 }
@@ -47,27 +70,42 @@ int TaskQueue::create_event_fd() {
 void TaskQueue::write_event_fd(int wakeup_fd) {
     uint64_t wakeup = 1;
     ssize_t res = ::write(wakeup_fd, &wakeup, sizeof(wakeup));
-    if (res < 0) {
-        // error
+    // EAGAIN only when the counter is about to overflow, it is readable then
+    if (res < 0 && errno != EAGAIN) {
+        LOG(ERROR) << "Writing eventfd " << wakeup_fd << " failed, errno " << errno;
     }
 }
 
 void TaskQueue::read_event_fd(int wakeup_fd) {
     uint64_t tmp;
     ssize_t res = ::read(wakeup_fd, &tmp, sizeof(tmp));
-    if (res < 0) {
-        // 
+    if (res < 0 && errno != EAGAIN) {
+        LOG(ERROR) << "Reading eventfd " << wakeup_fd << " failed, errno " << errno;
     }
 }
 
+// sampled by the pushing thread
+static chrono::steady_clock::time_point enqueue_stamp() {
+    if (LoopMetrics::local().sample_latency())
+        return chrono::steady_clock::now();
+    return {};
+}
+
 void TaskQueue::push(const CallBack & cb) {
     // no need to use call_soon, the mpsc queue can ensures no conficts
-    tasks.enqueue(cb);
+    num_pending.fetch_add(1, memory_order_relaxed);
+    tasks.enqueue(QueuedTask{enqueue_stamp(), cb});
     write_event_fd(wakeup_fd);
 }
 
 void TaskQueue::push(CallBack && cb) {
     // no need to use call_soon, the mpsc queue can ensures no conficts
-    tasks.enqueue(move(cb));
+    num_pending.fetch_add(1, memory_order_relaxed);
+    tasks.enqueue(QueuedTask{enqueue_stamp(), move(cb)});
+    write_event_fd(wakeup_fd);
+}
+
+
+void TaskQueue::wakeup() {
     write_event_fd(wakeup_fd);
 }
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <functional>
+#include <chrono>
+#include <utility>
 #include <sys/eventfd.h>
 #include <unistd.h>
 #include "../../utils/Common.h"
+#include "../../utils/Metrics.h"
 #include "MpscQueue.h"
 #include "Channel.h"
 #include "selectors/Selector.h"
@@ -19,10 +22,14 @@ protected:
     using CallBack = function<void()>;
     using PChannel = shared_ptr<Channel>;
     using RunInLoopCallBack = function<void(CallBack)>;
+    // stamped when queued, for the enqueue to execution delay
+    using QueuedTask = pair<chrono::steady_clock::time_point, CallBack>;
 
     int wakeup_fd;
     PChannel pch;
-    MpscQueue<CallBack> tasks;
+    MpscQueue<QueuedTask> tasks;
+    // queued but not yet executed, a hint for load balancing
+    atomic<size_t> num_pending {0};
     RunInLoopCallBack run_in_loop;
 
     void handle_wakeup();
@@ -38,11 +45,14 @@ public:
     static Channel::Protocol channel_protocol;
 
     void reset();
+    size_t size() const;
 
-    CallBack && pop();
+    CallBack pop();
 
     void push(const CallBack & cb);
     void push(CallBack && cb);
+    // wake the loop up without queueing a task
+    void wakeup();
 
 };
 
@@ -1,4 +1,6 @@
 #include "ThreadingEventLoop.h"
+#include "TimingWheel.h"
+#include <signal.h>
 #include <thread>
 #include <iostream>
 #include <functional>
@@ -8,18 +10,22 @@ using namespace std::placeholders;
 
 thread_local EventLoop * thread_loop_ptr = nullptr;
 
-EventLoop::EventLoop(string name)
+static const size_t TIMING_WHEEL_MAX_TIME = duration_cast<seconds>(24h).count();
+
+EventLoop::EventLoop(string name, int index)
     : name(name), 
+      _index(index),
       belonging_thread(this_thread::get_id()),
       selector(Selector::create_selector(
           bind(&EventLoop::handle_event, this, _1, _2))
       ),
+      cached_now(steady_clock::now()),
       taskq([this](auto && callback) {
           this->call_soon(forward<decltype(callback)>(callback));
       }, selector.get()),
       timerq([this](auto && callback) {
           this->call_soon(forward<decltype(callback)>(callback));
-      }, selector.get()),
+      }, selector.get(), cached_now),
       thread_loop_pptr(&thread_loop_ptr) {
 
     if (thread_loop_ptr) {
@@ -27,6 +33,8 @@ EventLoop::EventLoop(string name)
         exit(-1);
     }
     thread_loop_ptr = this;
+    stats.attach();
+    tracer.attach();
 }
 
 EventLoop::~EventLoop() {
@@ -37,6 +45,8 @@ EventLoop::~EventLoop() {
     }
     if (thread_loop_ptr == this)
         thread_loop_ptr = nullptr;
+    stats.detach();
+    tracer.detach();
     if (!_closed) {
         // error
     }
@@ -44,6 +54,19 @@ EventLoop::~EventLoop() {
 
 void EventLoop::handle_event(void * pdata, int event) {
     current_active_channel = pdata;
+    if constexpr (NETYO_TRACE) {
+        if (tracer.enabled()) {
+            // the channel might be destroyed by its callbacks
+            int fd = static_cast<Channel*>(pdata)->fd();
+            int64_t start = tracer.mark();
+            static_cast<Channel*>(pdata)->handle_events(event);
+            // or stopped by them
+            if (tracer.enabled())
+                tracer.complete_since(start, TraceType::DISPATCH, fd);
+            current_active_channel = nullptr;
+            return;
+        }
+    }
     static_cast<Channel*>(pdata)->handle_events(event);
     current_active_channel = nullptr;
 }
@@ -59,6 +82,61 @@ EventLoop* EventLoop::get_loop() {
     return this;
 }
 
+EventLoop* EventLoop::current() {
+    return thread_loop_ptr;
+}
+
+TimingWheel& EventLoop::timing_wheel() {
+    assert_within_self_thread();
+    if (!wheel) {
+        wheel.reset(new TimingWheel(this, TIMING_WHEEL_MAX_TIME));
+    }
+    return *wheel;
+}
+
+int EventLoop::add_poller(Poller poller) {
+    assert_within_self_thread();
+    pollers.emplace_back(++poller_id, make_shared<Poller>(move(poller)));
+    return poller_id;
+}
+
+void EventLoop::remove_poller(int id) {
+    assert_within_self_thread();
+    for (auto it = pollers.begin(); it != pollers.end(); ++it) {
+        if (it->first == id) {
+            pollers.erase(it);
+            return;
+        }
+    }
+}
+
+void EventLoop::set_flusher(Poller flusher) {
+    assert_within_self_thread();
+    this->flusher = move(flusher);
+}
+
+bool EventLoop::run_pollers() {
+    bool pending = false;
+    // pollers might add or remove pollers, including themselves
+    for (size_t i = 0; i < pollers.size(); ++i) {
+        auto poller = pollers[i].second;
+        pending |= (*poller)();
+    }
+    return pending;
+}
+
+nanoseconds EventLoop::poll_timeout() {
+    nanoseconds timeout = milliseconds(Selector::EPOLL_WAIT_TIMEOUT);
+    if (!timerq.use_timer_fd() && !timerq.empty()) {
+        // callbacks might have run for a while since the last select
+        update_time();
+        auto next = timerq.next_timeout();
+        if (next >= 0ns && next < timeout)
+            timeout = next;
+    }
+    return timeout;
+}
+
 void EventLoop::operator()() {
     run();
 }
@@ -67,9 +145,34 @@ void EventLoop::run() {
     if (events_handling || !within_self_thread()) {
         // error
     }
+    // sendfile() and OpenSSL's userspace writes can not pass MSG_NOSIGNAL, a
+    // peer's reset must end in EPIPE rather than kill the process. Blocked
+    // per thread, the process wide disposition is left to the application.
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+    bool pending = false;
     while (!_close) {
         events_handling = true;
-        selector->select();
+        int num_events = selector->select(pending ? 0ns : poll_timeout());
+        update_time();
+        if (num_events >= 0) {
+            stats.wakeups.inc();
+            stats.events.inc(num_events);
+            stats.events_per_wakeup.observe(num_events);
+        }
+        if constexpr (NETYO_TRACE) {
+            if (tracer.enabled())
+                tracer.complete(TraceType::SELECT, max(num_events, 0), cached_now);
+        }
+        selector->dispatch();
+        if (!timerq.use_timer_fd()) {
+            timerq.handle_exprired();
+        }
+        pending = pollers.size() && run_pollers();
+        if (flusher)
+            pending |= flusher();
         events_handling = false;
     }
     if (_close) {
@@ -78,25 +181,25 @@ void EventLoop::run() {
 }
 
 
-EventLoopThread::EventLoopThread(const string & name) 
+EventLoopThread::EventLoopThread(const string & name, int index) 
     : loopname(name),
+      index(index),
       loopthread([this]() { start_loop(); }) {
     loop = running_loop.get_future().get();
 }
 
 EventLoopThread::~EventLoopThread() {
-    if (loop) {
+    if (loopthread.joinable()) {
         close();
     }
 }
 
 void EventLoopThread::start_loop() {
-    EventLoop loop(loopname);
+    EventLoop loop(loopname, index);
     loop.call_soon([this, &loop]() {
         running_loop.set_value(&loop);
     });
     loop.run();
-    this->loop = nullptr;
 }
 
 const string & EventLoopThread::name() const {
@@ -108,13 +211,14 @@ EventLoop* EventLoopThread::get_loop() {
 }
 
 void EventLoopThread::close() {
-    loop->close();
+    if (loop && loopthread.joinable())
+        loop->close();
     join();
     loop = nullptr;
 }
 
 void EventLoopThread::join() {
-    if (loop) {
+    if (loopthread.joinable()) {
         loopthread.join();
     }
 }
@@ -131,7 +235,7 @@ ThreadingEventLoop::ThreadingEventLoop(int num, const string & name)
       poolname(name) {
     for (int i = 0; i < thread_num; i++) {
         threads.emplace_back(
-            make_shared<EventLoopThread>(BASE_THREAD_NAME + to_string(i))
+            make_shared<EventLoopThread>(BASE_THREAD_NAME + to_string(i), i)
         );
     }
 }
@@ -152,12 +256,138 @@ void ThreadingEventLoop::wait() {
     join();
 }
 
-EventLoop* ThreadingEventLoop::get_loop(bool mainloop = false) {
-    if (mainloop) {
+int ThreadingEventLoop::size() const {
+    return thread_num;
+}
+
+EventLoop* ThreadingEventLoop::get_loop(bool mainloop) {
+    if (mainloop || threads.size() == 1) {
         return threads[0]->get_loop();
     }
     else {
         thread_index = (thread_index + 1) % (threads.size() - 1);
         return threads[thread_index + 1]->get_loop();
     }
-}
\ No newline at end of file
+}
+
+EventLoop* ThreadingEventLoop::loop_at(int index) {
+    return threads[index % threads.size()]->get_loop();
+}
+
+vector<EventLoop*> ThreadingEventLoop::loops() {
+    vector<EventLoop*> res;
+    for (auto & pth : threads) {
+        res.push_back(pth->get_loop());
+    }
+    return res;
+}
+
+MetricsSnapshot ThreadingEventLoop::metrics() {
+    MetricsSnapshot snapshot;
+    for (auto loop : loops()) {
+        if (loop)
+            loop->metrics().collect(snapshot);
+    }
+    if (budget)
+        budget->collect(snapshot);
+    return snapshot;
+}
+
+MemoryBudget& ThreadingEventLoop::set_memory_budget(size_t bytes,
+                                                    const microseconds & interval) {
+    budget = make_shared<MemoryBudget>(bytes, threads.size());
+    broadcast([budget = budget, interval](EventLoop * loop) {
+        loop->set_memory_budget(budget.get());
+        loop->call_every([budget, loop]() {
+            budget->reconcile(loop->index(), loop->metrics().buffer_bytes.value());
+        }, interval);
+    });
+    return *budget;
+}
+
+void ThreadingEventLoop::start_tracing(size_t capacity) {
+    broadcast([capacity](EventLoop * loop) {
+        loop->trace().start(capacity);
+    });
+}
+
+void ThreadingEventLoop::stop_tracing() {
+    broadcast([](EventLoop * loop) {
+        loop->trace().stop();
+    });
+}
+
+namespace {
+
+struct TraceDump {
+    EventLoop * home;
+    function<void(string)> done;
+    size_t chunk;
+    vector<pair<string, vector<TraceEvent>>> timelines;
+    atomic<size_t> copying;
+    ChromeTraceWriter writer;
+    // the next event to format
+    size_t tid = 0, pos = 0;
+};
+
+// within the home loop, the rest is left for a later iteration
+void format_trace(shared_ptr<TraceDump> dump) {
+    size_t budget = dump->chunk;
+    auto & timelines = dump->timelines;
+    while (dump->tid < timelines.size()) {
+        auto & [name, events] = timelines[dump->tid];
+        if (dump->pos == 0)
+            dump->writer.thread_name(dump->tid, name);
+        size_t num = min(budget, events.size() - dump->pos);
+        dump->writer.add(dump->tid, events.data() + dump->pos, num);
+        dump->pos += num;
+        budget -= num;
+        if (dump->pos == events.size()) {
+            vector<TraceEvent>().swap(events);
+            dump->tid++;
+            dump->pos = 0;
+        }
+        if (!budget) {
+            dump->home->post([dump]() { format_trace(dump); });
+            return;
+        }
+    }
+    dump->done(dump->writer.finish());
+}
+
+}
+
+void ThreadingEventLoop::dump_trace(function<void(string)> done, size_t chunk) {
+    auto dump = make_shared<TraceDump>();
+    dump->home = EventLoop::awaiting_loop();
+    dump->done = move(done);
+    dump->chunk = max<size_t>(chunk, 1);
+    auto all = loops();
+    for (size_t i = 0; i < all.size(); ++i)
+        dump->timelines.emplace_back(threads[i]->name(), vector<TraceEvent>());
+    dump->copying = all.size();
+    for (size_t i = 0; i < all.size(); ++i) {
+        EventLoop * loop = all[i];
+        loop->call_soon([loop, i, dump]() {
+            dump->timelines[i].second = loop->trace().events();
+            // the last one to copy hands the timelines to the home loop
+            if (dump->copying.fetch_sub(1, memory_order_acq_rel) == 1)
+                dump->home->post([dump]() { format_trace(dump); });
+        });
+    }
+}
+
+EventLoop* ThreadingEventLoop::least_loaded_loop() {
+    size_t start = balance_index.fetch_add(1, memory_order_relaxed);
+    EventLoop* best = nullptr;
+    size_t best_load = 0;
+    for (size_t i = 0; i < threads.size(); ++i) {
+        EventLoop* loop = threads[(start + i) % threads.size()]->get_loop();
+        size_t load = loop->load();
+        if (!best || load < best_load) {
+            best = loop;
+            best_load = load;
+        }
+    }
+    return best;
+}
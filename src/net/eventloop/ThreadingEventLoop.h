@@ -5,19 +5,43 @@
 #include "TaskQueue.h"
 #include "../../utils/Logging.h"
 #include "../../utils/Common.h"
+#include "../../utils/Metrics.h"
+#include "../../utils/Trace.h"
+#include "MemoryBudget.h"
 #include "selectors/Selector.h"
 #include <thread>
 #include <future>
+#include <coroutine>
+#include <optional>
+#include <vector>
+#include <type_traits>
 using namespace std;
 using namespace chrono;
 
 
+class TimingWheel;
+
 class EventLoop {
 public:
+    // runs once per iteration after events and timers, returns true while
+    // work is left over so that the next select() does not block
+    using Poller = function<bool()>;
+
     unique_ptr<Selector> selector;
 protected:
+    LoopMetrics stats;
+    Tracer tracer;
+    // snapshot of the monotonic clock, refreshed once per select() return
+    Time cached_now;
     TaskQueue taskq;
     TimerQueue timerq;
+    unique_ptr<TimingWheel> wheel;
+    vector<pair<int, shared_ptr<Poller>>> pollers;
+    int poller_id = 0;
+    // runs after all pollers, see set_flusher()
+    Poller flusher;
+    // shared by the loops of a ThreadingEventLoop, if any
+    MemoryBudget* budget = nullptr;
 
     
     bool events_handling = false, _close = false, _closed = false;  
@@ -26,13 +50,42 @@ protected:
     thread::id belonging_thread;
     EventLoop** thread_loop_pptr = nullptr;
     string name;
+    // position within the owning ThreadingEventLoop
+    int _index = 0;
+
+    bool run_pollers();
 
 public:
-    EventLoop(string name);
+    EventLoop(string name, int index = 0);
     ~EventLoop();
     void close();
+    // the loop stopped running, e.g. members are being torn down
+    bool is_closed() const { return _closed; }
+    // queued tasks plus registered fds, readable from any thread
+    size_t load() const {
+        return taskq.size() + selector->size();
+    }
 
     EventLoop* get_loop();
+    int index() const { return _index; }
+    // the loop running in the calling thread, nullptr if there is none
+    static EventLoop* current();
+    // current(), which must exist: awaiters and callbacks resume there
+    static EventLoop* awaiting_loop() {
+        EventLoop* loop = current();
+        if (!loop)
+            LOG(FATAL) << "Awaiting outside of a loop's thread, use submit_future()";
+        return loop;
+    }
+    // coarse(one second tick) timeouts, e.g. idle connections
+    TimingWheel& timing_wheel();
+    // updated within the loop's thread, readable from any thread
+    LoopMetrics& metrics() { return stats; }
+    // only used within the loop's thread, see ThreadingEventLoop::dump_trace()
+    Tracer& trace() { return tracer; }
+    MemoryBudget* memory_budget() const { return budget; }
+    // within the loop's thread, see ThreadingEventLoop::set_memory_budget()
+    void set_memory_budget(MemoryBudget* budget) { this->budget = budget; }
 
     bool within_self_thread() const {
         return belonging_thread == this_thread::get_id();
@@ -46,8 +99,24 @@ public:
 
     void run();
     void operator()();
+    nanoseconds poll_timeout();
     void handle_event(void * pdata, int event);
 
+    // coarse clock for timeouts/timers, only meaningful within the loop's thread
+    const Time & now() const {
+        return cached_now;
+    }
+    // refresh the cached clock, e.g. after a long running callback
+    const Time & update_time() {
+        return cached_now = steady_clock::now();
+    }
+    static Time precise_now() {
+        return steady_clock::now();
+    }
+    Time current_time() const {
+        return within_self_thread() ? cached_now : precise_now();
+    }
+
     template <typename CallBack>
     void call_soon(CallBack&& cb) {
         if (within_self_thread() && !_close) {
@@ -58,23 +127,47 @@ public:
         }
     }
 
+    // queued even within the loop's thread, cb runs in a later iteration
+    // and never within the caller's frame, e.g. to resume a coroutine
     template <typename CallBack>
-    void call_later(CallBack&& cb, const microseconds & delay = 0s) {
-        return call_at(forward<CallBack>(cb), steady_clock::now() + delay);
+    void post(CallBack&& cb) {
+        if (!_closed)
+            taskq.push(forward<CallBack>(cb));
     }
 
     template <typename CallBack>
-    void call_at(CallBack&& cb, const time_point<steady_clock> & time) {
-        if (time > steady_clock::now()) {
-            timerq.add_timer(forward<CallBack>(cb), time);
-        }
+    TimerId call_later(CallBack&& cb, const microseconds & delay = 0s) {
+        // the cached clock lags behind by the time spent in callbacks,
+        // which is too coarse for short delays
+        return call_at(forward<CallBack>(cb), precise_now() + delay);
     }
 
+    // a time in the past fires in the next iteration
     template <typename CallBack>
-    void call_every(CallBack&& cb, const microseconds & interval) {
-        timerq.add_timer(forward<CallBack>(cb), 
-                         steady_clock::now() + interval, 
-                         interval);
+    TimerId call_at(CallBack&& cb, const time_point<steady_clock> & time) {
+        return timerq.add_timer(forward<CallBack>(cb), time);
+    }
+
+    template <typename CallBack>
+    TimerId call_every(CallBack&& cb, const microseconds & interval) {
+        return timerq.add_timer(forward<CallBack>(cb), 
+                                precise_now() + interval, 
+                                interval);
+    }
+
+    void cancel(TimerId timer_id) {
+        timerq.remove_timer(timer_id);
+    }
+
+    // within the loop's thread, returns an id for remove_poller()
+    int add_poller(Poller poller);
+    void remove_poller(int id);
+    // within the loop's thread: the last step of every iteration, after all
+    // pollers, so whatever they sent still goes out, e.g. buffered writes
+    void set_flusher(Poller flusher);
+    // safe to call from any thread, e.g. after handing data to a poller
+    void wakeup() {
+        taskq.wakeup();
     }
 };
 
@@ -88,14 +181,16 @@ protected:
 
     EventLoop* loop = nullptr;
     string loopname;
+    int index;
+    // must be constructed before the thread starts using it
+    promise<EventLoop *> running_loop;
     thread loopthread;
 
-    promise<EventLoop *> running_loop;
     void start_loop();
     EventLoop* get_loop();
 
 public:
-    EventLoopThread(const string & name);
+    EventLoopThread(const string & name, int index = 0);
     ~EventLoopThread();
     const string & name() const;
     void close();
@@ -105,12 +200,93 @@ public:
 
 
 
+// Resumes the awaiting coroutine on its own loop with the result of func
+// executed on the target loop.
+template <typename R>
+class SubmitAwaiter {
+private:
+    using Func = function<R()>;
+    EventLoop * target;
+    Func func;
+    conditional_t<is_void_v<R>, bool, optional<R>> result {};
+
+public:
+    SubmitAwaiter(EventLoop * target, Func func)
+        : target(target), func(move(func)) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) {
+        EventLoop * home = EventLoop::awaiting_loop();
+        // posted, func may run inline when target is home
+        target->call_soon([this, home, h]() {
+            if constexpr (is_void_v<R>) {
+                func();
+                home->post([h]() { h.resume(); });
+            }
+            else {
+                home->post([this, h, res = func()]() mutable {
+                    result.emplace(move(res));
+                    h.resume();
+                });
+            }
+        });
+    }
+    R await_resume() {
+        if constexpr (!is_void_v<R>)
+            return move(*result);
+    }
+};
+
+// Collects func(loop) of every loop into a vector on the awaiting loop.
+template <typename R>
+class GatherAwaiter {
+private:
+    using Func = function<R(EventLoop *)>;
+    vector<EventLoop *> loops;
+    Func func;
+    vector<optional<R>> results;
+    size_t remain = 0;
+
+public:
+    GatherAwaiter(vector<EventLoop *> loops, Func func)
+        : loops(move(loops)), func(move(func)) {}
+
+    bool await_ready() const noexcept { return loops.empty(); }
+    void await_suspend(coroutine_handle<> h) {
+        EventLoop * home = EventLoop::awaiting_loop();
+        results.resize(loops.size());
+        remain = loops.size();
+        // the results are posted, so the coroutine never resumes(and destroys
+        // this awaiter) before the loop below is done
+        for (size_t i = 0; i < loops.size(); ++i) {
+            loops[i]->call_soon([this, home, h, i]() {
+                home->post([this, h, i, res = func(loops[i])]() mutable {
+                    // only touched within the awaiting loop
+                    results[i].emplace(move(res));
+                    if (--remain == 0)
+                        h.resume();
+                });
+            });
+        }
+    }
+    vector<R> await_resume() {
+        vector<R> values;
+        values.reserve(results.size());
+        for (auto & res : results)
+            values.push_back(move(*res));
+        return values;
+    }
+};
+
+
 class ThreadingEventLoop {
 private:
     int thread_num = 1;
     string poolname;
     vector<shared_ptr<EventLoopThread>> threads;
     int thread_index = 0; 
+    atomic<size_t> balance_index {0};
+    shared_ptr<MemoryBudget> budget;
 public:
     static string BASE_THREAD_NAME;
 
@@ -121,23 +297,150 @@ public:
     void join();
     void wait();
 
-    EventLoop * get_loop(bool mainloop);
-
+    // round robin over the worker loops, the first loop is the main loop
+    EventLoop * get_loop(bool mainloop = false);
+    EventLoop * loop_at(int index);
+    vector<EventLoop *> loops();
+    // merged metrics of all loops, safe to call from any thread
+    MetricsSnapshot metrics();
+    // limits the buffer memory of all loops, see MemoryBudget. Called once
+    // before serving, every loop reconciles its usage each interval.
+    MemoryBudget& set_memory_budget(size_t bytes, const microseconds & interval = 10ms);
+    MemoryBudget* memory_budget() const { return budget.get(); }
+    // event timelines of all loops, only recorded with NETYO_TRACE compiled in
+    void start_tracing(size_t capacity = 1 << 16);
+    void stop_tracing();
+    // chrome trace_event JSON of the events recorded so far. Called within a
+    // loop, without blocking it: every loop copies its timeline within its
+    // own thread, then the calling loop formats chunk events per iteration
+    // and done(json) runs there.
+    void dump_trace(function<void(string)> done, size_t chunk = 4096);
+    // safe to call from any thread, ties are broken round robin
+    EventLoop * least_loaded_loop();
+
+    // run on the least loaded loop
     template <typename CallBack>
-        void call_soon(CallBack&& cb);
+    void call_soon(CallBack&& cb) {
+        least_loaded_loop()->call_soon(forward<CallBack>(cb));
+    }
 
     template <typename CallBack>
     void call_later(CallBack&& cb, const microseconds & delay = 0ms) {
-
+        least_loaded_loop()->call_later(forward<CallBack>(cb), delay);
     }
 
     template <typename CallBack>
     void call_at(CallBack&& cb, const time_point<steady_clock> & time) {
-
+        least_loaded_loop()->call_at(forward<CallBack>(cb), time);
     }
 
     template <typename CallBack>
     void call_every(CallBack&& cb, const microseconds & interval) {
+        least_loaded_loop()->call_every(forward<CallBack>(cb), interval);
+    }
+
+    // cb(EventLoop*) runs once within every loop
+    template <typename CallBack>
+    void broadcast(const CallBack & cb) {
+        for (auto loop : loops()) {
+            loop->call_soon([cb, loop]() { cb(loop); });
+        }
+    }
+
+    // cb(EventLoop*) runs periodically within every loop, e.g. per shard
+    // maintenance
+    template <typename CallBack>
+    void broadcast_every(const CallBack & cb, const microseconds & interval) {
+        for (auto loop : loops()) {
+            loop->call_every([cb, loop]() { cb(loop); }, interval);
+        }
+    }
+
+    // spread callbacks over the loops by load, with a single queue push
+    // per destination loop.
+    template <typename Iterator>
+    void call_soon_bulk(Iterator first, Iterator last) {
+        auto dests = loops();
+        vector<size_t> loads;
+        for (auto loop : dests)
+            loads.push_back(loop->load());
+        vector<vector<function<void()>>> batches(dests.size());
+        for (; first != last; ++first) {
+            size_t i = min_element(loads.begin(), loads.end()) - loads.begin();
+            batches[i].emplace_back(*first);
+            loads[i]++;
+        }
+        for (size_t i = 0; i < dests.size(); ++i) {
+            if (batches[i].empty())
+                continue;
+            dests[i]->call_soon([batch = move(batches[i])]() {
+                for (auto & cb : batch)
+                    cb();
+            });
+        }
+    }
+
+    // co_await within a loop, func runs on the target(least loaded) loop
+    // and the awaiting coroutine resumes on its own loop.
+    template <typename Func, typename R = invoke_result_t<Func>>
+    SubmitAwaiter<R> submit(EventLoop * target, Func && func) {
+        return {target, forward<Func>(func)};
+    }
+
+    template <typename Func, typename R = invoke_result_t<Func>>
+    SubmitAwaiter<R> submit(Func && func) {
+        return {least_loaded_loop(), forward<Func>(func)};
+    }
+
+    // from any thread, e.g. outside the pool. get() must not be called
+    // within target's own thread, which would wait for itself.
+    template <typename Func, typename R = invoke_result_t<Func>>
+    future<R> submit_future(EventLoop * target, Func && func) {
+        auto result = make_shared<promise<R>>();
+        auto fut = result->get_future();
+        target->call_soon([result, func = forward<Func>(func)]() mutable {
+            try {
+                if constexpr (is_void_v<R>) {
+                    func();
+                    result->set_value();
+                }
+                else {
+                    result->set_value(func());
+                }
+            }
+            catch (...) {
+                result->set_exception(current_exception());
+            }
+        });
+        return fut;
+    }
+
+    template <typename Func, typename R = invoke_result_t<Func>>
+    future<R> submit_future(Func && func) {
+        return submit_future(least_loaded_loop(), forward<Func>(func));
+    }
+
+    // callback version, then(result) runs within the calling loop.
+    template <typename Func, typename Then>
+    void submit(EventLoop * target, Func && func, Then && then) {
+        EventLoop * home = EventLoop::awaiting_loop();
+        target->call_soon([home, func = forward<Func>(func), 
+                           then = forward<Then>(then)]() mutable {
+            if constexpr (is_void_v<invoke_result_t<Func>>) {
+                func();
+                home->call_soon(move(then));
+            }
+            else {
+                home->call_soon([then = move(then), res = func()]() mutable {
+                    then(move(res));
+                });
+            }
+        });
+    }
 
+    // co_await within a loop, collects func(loop) of every loop
+    template <typename Func, typename R = invoke_result_t<Func, EventLoop *>>
+    GatherAwaiter<R> gather(Func && func) {
+        return {loops(), forward<Func>(func)};
     }
 };
\ No newline at end of file
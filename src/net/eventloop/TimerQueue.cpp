@@ -1,4 +1,7 @@
 #include "TimerQueue.h"
+#include "../../utils/Metrics.h"
+#include "../../utils/Logging.h"
+#include "../../utils/Trace.h"
 #include <sys/times.h>
 #include <sys/timerfd.h>
 #include <unistd.h>
@@ -34,26 +37,52 @@ Channel::Protocol TimerQueue::channel_protocol = {
 };
 
 TimerQueue::TimerQueue(const RunInLoopCallBack & run_in_loop, 
-                              Selector * selector)
+                              Selector * selector,
+                              const Time & loop_time)
     : run_in_loop(run_in_loop),
-      timer_fd(create_timer_fd()),
-      pch(new Channel(timer_fd, this, selector, &channel_protocol)) {
+      timer_fd(selector->precise_timeout() ? -1 : create_timer_fd()),
+      loop_time(loop_time) {
+    if (use_timer_fd()) {
+        pch.reset(new Channel(timer_fd, this, selector, &channel_protocol));
         pch->enable(Channel::READ);
+    }
 }
 
 TimerQueue::~TimerQueue() {
-    run_in_loop([this]() {
-        ::close(timer_fd);
-    });
+    if (use_timer_fd()) {
+        run_in_loop([this]() {
+            ::close(timer_fd);
+        });
+    }
+}
+
+void TimerQueue::pop_invalid() {
+    while (timers.size() && !valid_timers.count(timers.top()->id())) {
+        timers.pop();
+    }
+}
+
+nanoseconds TimerQueue::next_timeout() {
+    pop_invalid();
+    if (timers.empty())
+        return nanoseconds(-1);
+    return max(nanoseconds(0), 
+               duration_cast<nanoseconds>(timers.top()->when() - loop_time));
 }
 
 void TimerQueue::handle_exprired() {
-    read_timer_fd(timer_fd);
-    auto now = std::chrono::steady_clock::now();
-    while (timers.size() && timers.top()->when() < now) {
+    if (use_timer_fd())
+        read_timer_fd(timer_fd);
+    const Time & now = loop_time;
+    size_t num_fired = 0;
+    auto & timer_lag = LoopMetrics::local().timer_lag;
+    while (timers.size() && timers.top()->when() <= now) {
         auto ptimer = timers.top(); timers.pop();
         if (valid_timers.count(ptimer->id())) {
-            ptimer->run();
+            timer_lag.record(duration_cast<nanoseconds>(now - ptimer->when()).count());
+            ptimer->run(now);
+            TRACE(complete(TraceType::TIMER, static_cast<int32_t>(ptimer->id())));
+            num_fired++;
             if (ptimer->is_repeat()) {
                 insert(ptimer);
             }
@@ -62,16 +91,17 @@ void TimerQueue::handle_exprired() {
             }
         }
     }
-    if (timers.size()) {
-        write_timer_fd(timer_fd, timers.top()->when());
-    }
-    else {
+    pop_invalid();
+    if (num_fired)
+        LoopMetrics::local().timers_fired.inc(num_fired);
+    if (use_timer_fd() && timers.size()) {
+        write_timer_fd(timer_fd, timers.top()->when(), now);
     }
 }
 
 
 void TimerQueue::remove_timer(TimerId timer_id) {
-    run_in_loop([=](){
+    run_in_loop([=, this](){
         erase(timer_id);
     });
 }
@@ -88,32 +118,31 @@ void TimerQueue::erase(TimerId timer_id) {
 int TimerQueue::create_timer_fd() {
     int timer_fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
     if (timer_fd < 0) {
-        // error
+        LOG(FATAL) << "timerfd_create failed, errno " << errno;
     }
-    return timer_fd;;
+    return timer_fd;
 }
 
-void TimerQueue::write_timer_fd(int timer_fd, const Time & expire_time) {
-    auto remain_ms = 1500ms;
-    auto now = steady_clock::now();
-    if (expire_time > now + 1500ms) {
-        remain_ms = duration_cast<milliseconds>(expire_time - now);
-    }
-    auto sec = duration_cast<seconds>(remain_ms).count();
-    auto nanosec = duration_cast<nanoseconds>(remain_ms).count();
-    itimerspec newtime {{}, {sec, (nanosec % (sec * nanoseconds::period::den))}};
+void TimerQueue::write_timer_fd(int timer_fd, const Time & expire_time,
+                                const Time & now) {
+    // a zero it_value disarms the timer, expire at least 1us later
+    auto remain = max(nanoseconds(1us), 
+                      duration_cast<nanoseconds>(expire_time - now));
+    auto nanosec = remain.count();
+    itimerspec newtime {{}, {static_cast<time_t>(nanosec / 1000000000),
+                             static_cast<long>(nanosec % 1000000000)}};
     itimerspec oldtime{};
 
     int res = ::timerfd_settime(timer_fd, 0, &newtime, &oldtime);
     if (res < 0) {
-        // 
+        LOG(ERROR) << "timerfd_settime on fd " << timer_fd << " failed, errno " << errno;
     }
 }
 
 void TimerQueue::read_timer_fd(int timer_fd) {
     uint64_t tmp;
     ssize_t n = ::read(timer_fd, &tmp, sizeof(tmp));
-    if (n < 0) {
-        // error
+    if (n < 0 && errno != EAGAIN) {
+        LOG(ERROR) << "Reading timerfd " << timer_fd << " failed, errno " << errno;
     }
 }
\ No newline at end of file
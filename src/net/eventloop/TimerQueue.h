@@ -50,10 +50,14 @@ public:
         return _id;
     }
 
-    void run() {
+    void run(const Time & now) {
         callback();
-        if (interval > 0ms)
-            _when = chrono::steady_clock::now() + interval;
+        if (interval > 0ms) {
+            // keep the pace of repeat timers, skip missed periods
+            _when += interval;
+            if (_when <= now)
+                _when = now + interval;
+        }
     }
     
     Time when() const { return _when; }
@@ -65,6 +69,10 @@ using namespace std;
 using namespace chrono;
 
 // all resource operations are not atomic, need use call_soon for inclusive calling.
+// When the selector supports precise timeouts, the owning loop drives the
+// queue by passing next_timeout() to select() and calling handle_exprired()
+// after dispatching events. Otherwise a timerfd armed with the earliest
+// deadline is registered in the selector.
 class TimerQueue : public NoCopyble {
 protected:
     using PTimer = shared_ptr<Timer>;
@@ -78,35 +86,45 @@ protected:
     };
 
     int timer_fd;
+    // the owning loop's cached clock
+    const Time & loop_time;
     PChannel pch;
     unordered_set<TimerId> valid_timers;
     priority_queue<PTimer, deque<PTimer>, Cmp> timers;    
     RunInLoopCallBack run_in_loop;
 
-    void handle_exprired();
-
     void reset(const vector<PTimer> & expired, const Time & time);
     void insert(const PTimer & timer_node);
     void erase(TimerId timer_id);
     static int create_timer_fd();
-    static void write_timer_fd(int timer_fd, const Time & expire_time);
+    static void write_timer_fd(int timer_fd, const Time & expire_time,
+                               const Time & now);
+    void pop_invalid();
     static void read_timer_fd(int timer_fd);
 
 public:
-    TimerQueue(const RunInLoopCallBack & run_in_loop, Selector* selector);
+    TimerQueue(const RunInLoopCallBack & run_in_loop, Selector* selector,
+               const Time & loop_time);
     ~TimerQueue();
 
     static Channel::Protocol channel_protocol;
 
+    bool use_timer_fd() const { return timer_fd >= 0; }
+    bool empty() const { return timers.empty(); }
+    // time left until the earliest timer expires, relative to the loop's clock
+    nanoseconds next_timeout();
+    void handle_exprired();
+
     template <typename Func>
     TimerId add_timer(Func && cb, 
                     const Time & time, 
                     const Interval & interval = 0ms) {
         auto timer_node = make_shared<Timer>(forward<Func>(cb), 
                                               time, interval);
-        run_in_loop([=](){
-            if (timers.empty() || timer_node < timers.top()) {
-                write_timer_fd(timer_fd, timer_node->when());
+        run_in_loop([=, this](){
+            if (use_timer_fd() && 
+                (timers.empty() || *timer_node < *timers.top())) {
+                write_timer_fd(timer_fd, timer_node->when(), loop_time);
             }
             insert(timer_node);
         });
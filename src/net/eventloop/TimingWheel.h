@@ -0,0 +1,134 @@
+/**
+ *
+ *  TimingWheel.cc
+ *  An Tao
+ *
+ *  Public header file in trantor lib.
+ *
+ *  Copyright 2018, An Tao.  All rights reserved.
+ *  Use of this source code is governed by a BSD-style license
+ *  that can be found in the License file.
+ *
+ *
+ */
+
+// modified version
+
+#pragma once
+#include "../../utils/Common.h"
+#include "../../utils/Pool.h"
+#include <unordered_set>
+#include <vector>
+#include <memory>
+#include <functional>
+#include "ThreadingEventLoop.h"
+#include <chrono>
+
+using namespace std;
+using namespace chrono;
+
+// Not thread safe, every EventLoop owns one wheel and all insertions must
+// happen within the loop's thread. Entries are expired by dropping the
+// last reference, so the expiring action lives in the entry's destructor.
+// Bucket nodes come from the loop's BlockPool and the buckets are rotated
+// in place, refreshing an entry allocates nothing once the pool is warm.
+class TimingWheel : public NoCopyble {
+protected:
+    using SPEntry = shared_ptr<void>;
+    using EntryBucket = unordered_set<SPEntry, hash<SPEntry>, equal_to<SPEntry>,
+                                      PoolAllocator<SPEntry>>;
+    EventLoop * loop = nullptr;
+    // the buckets of wheel i start at heads[i], the first one expires next
+    vector<vector<EntryBucket>> wheels;
+    vector<size_t> heads;
+    // expired entries are released from here, it keeps its bucket array
+    EntryBucket expired;
+    size_t curtick = 0;
+    
+    size_t tick_interval = 1, nwheel = 1, bucket_size = 100;
+
+    class CallBackEntry {
+    private:
+        using CallBack = function<void()>;
+        CallBack cb;
+    public:
+        CallBackEntry(CallBack cb) : cb(move(cb)) {}
+        ~CallBackEntry() { cb(); }
+    };
+
+public:
+    TimingWheel(EventLoop * loop, size_t max_time, size_t tick_interval = 1) 
+        : loop(loop), 
+          tick_interval(tick_interval) {
+        
+        size_t num_tick = max_time / tick_interval + 1;
+        size_t cur_num_tick = bucket_size;
+        while (cur_num_tick < num_tick) {
+            nwheel++;
+            cur_num_tick *= bucket_size;
+        }
+        // initialize timing wheels
+        wheels = vector<vector<EntryBucket>>(nwheel, vector<EntryBucket>(bucket_size));
+        heads.assign(nwheel, 0);
+
+        loop->call_every([=, this]() {
+            size_t t = ++curtick;
+            size_t base = 1;
+            for (size_t i = 0; i < nwheel; ++i) {
+                if (t % base == 0) {
+                    // the first bucket becomes the last one, emptied before
+                    // entries' destructors may insert into the wheel again
+                    bucket(i, 0).swap(expired);
+                    heads[i] = (heads[i] + 1) % bucket_size;
+                    expired.clear();
+                }
+                base *= bucket_size;
+            }
+        },
+        seconds(tick_interval));
+    }
+
+    // ~TimingWheell()      default is fine
+
+    // the k-th bucket of wheel i from the one expiring next
+    EntryBucket& bucket(size_t i, size_t k) {
+        return wheels[i][(heads[i] + k) % bucket_size];
+    }
+
+    size_t ticks() const {
+        return curtick;
+    }
+
+    void insert_in_loop(size_t delay, SPEntry spentry) {
+        loop->assert_within_self_thread();
+        delay = delay / tick_interval + 1;
+        size_t t = curtick;
+        for (size_t i = 0; i < nwheel; ++i) {
+            if (delay <= bucket_size) {
+                bucket(i, delay - 1).insert(spentry);
+                break;
+            }
+            if (i < nwheel - 1) {
+                // re-insert into the lower wheel when the upper bucket expires
+                spentry = make_shared<CallBackEntry>([=, this](){
+                    bucket(i, (delay + (t % bucket_size) - 1) % bucket_size)
+                        .insert(spentry);
+                });
+            }
+            else {
+                bucket(i, bucket_size - 1).insert(spentry);
+            }
+            delay = (delay + (t % bucket_size) - 1) / bucket_size;
+            t /= bucket_size;
+        }
+    }
+
+    void insert(size_t delay, SPEntry spentry) {
+        if (loop->within_self_thread()) {
+            insert_in_loop(delay, move(spentry));
+        }
+        else {
+            loop->call_soon([=, this](){ insert_in_loop(delay, spentry); });
+        }
+    }
+};
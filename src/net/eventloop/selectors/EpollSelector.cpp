@@ -1,7 +1,11 @@
 #include "EpollSelector.h"
+#include "../../../utils/Metrics.h"
+#include "../../../utils/Logging.h"
 #include <poll.h>
 #include <sys/epoll.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <assert.h>
 #include <iostream>
 using namespace std;
@@ -9,7 +13,21 @@ using namespace std;
 EpollSelector::EpollSelector(Selector::EventHandler && handler)
     : Selector(move(handler)),
       epoll_fd(::epoll_create1(EPOLL_CLOEXEC)),
-      events(EVENTS_LIST_SIZE) {}
+      events(EVENTS_LIST_SIZE) {
+    precise = support_pwait2(epoll_fd);
+}
+
+// epoll_pwait2 takes a timespec timeout (linux 5.11+), call it through
+// syscall() as older libc don't wrap it.
+bool EpollSelector::support_pwait2(int epoll_fd) {
+#ifdef SYS_epoll_pwait2
+    epoll_event event;
+    timespec ts {0, 0};
+    return ::syscall(SYS_epoll_pwait2, epoll_fd, &event, 1, &ts, nullptr, 0) >= 0;
+#else
+    return false;
+#endif
+}
 
 EpollSelector::~EpollSelector() {
     ::close(epoll_fd);
@@ -19,16 +37,40 @@ int EpollSelector::fd() {
     return epoll_fd;
 }
 
-void EpollSelector::select(int timeout) {
-    int num_events = static_cast<size_t>(::epoll_wait(
-        epoll_fd, 
-        &events.front(), 
-        static_cast<int>(events.size()),
-        timeout
-    ));
-    if (errno != EINTR) {
-        // FATAL << "Epoll wait failed with error: " << errno << "\n";
+int EpollSelector::select(chrono::nanoseconds timeout) {
+#ifdef SYS_epoll_pwait2
+    if (precise) {
+        auto nsec = timeout.count();
+        timespec ts {static_cast<time_t>(nsec / 1000000000), 
+                     static_cast<long>(nsec % 1000000000)};
+        num_events = static_cast<int>(::syscall(SYS_epoll_pwait2,
+            epoll_fd,
+            &events.front(),
+            static_cast<int>(events.size()),
+            nsec < 0 ? nullptr : &ts,
+            nullptr, 0
+        ));
+    }
+    else
+#endif
+    {
+        // round up, waking up too early only spins the loop once more
+        int timeout_ms = timeout.count() < 0 ? -1 : static_cast<int>(
+            chrono::ceil<chrono::milliseconds>(timeout).count());
+        num_events = static_cast<size_t>(::epoll_wait(
+            epoll_fd, 
+            &events.front(), 
+            static_cast<int>(events.size()),
+            timeout_ms
+        ));
     }
+    if (num_events < 0 && errno != EINTR) {
+        LOG(FATAL) << "Epoll wait failed, errno " << errno;
+    }
+    return num_events;
+}
+
+void EpollSelector::dispatch() {
     if (num_events <= 0) {
         return;
     }
@@ -46,11 +88,13 @@ void EpollSelector::select(int timeout) {
         else if (num_events < events.size() / 4) {
             events.resize(events.size() / 4);
         }
+        num_events = 0;
     }
 }
 
 void EpollSelector::add(int fd, int events, void* pdata) {
     update(EPOLL_CTL_ADD, fd, events, pdata);
+    num_fds.fetch_add(1, memory_order_relaxed);
 }
 
 void EpollSelector::modify(int fd, int events, void* pdata) {
@@ -59,14 +103,16 @@ void EpollSelector::modify(int fd, int events, void* pdata) {
 
 void EpollSelector::remove(int fd) {
     update(EPOLL_CTL_DEL, fd);
+    num_fds.fetch_sub(1, memory_order_relaxed);
 }
 
 void EpollSelector::update(int op, int fd, int newevents, void* pdata) {
     epoll_event event{};
-    event.events = newevents | EPOLLET;
+    event.events = (newevents & ~EDGE) | (newevents & EDGE ? EPOLLET : 0);
     event.data.ptr = pdata;
+    LoopMetrics::local().epoll_ctls.inc();
     if (::epoll_ctl(epoll_fd, op, fd, &event) < 0) {
-        // error
-        // FATAL << "Update epoll event failed \n";
+        LOG(ERROR) << "epoll_ctl op " << op << " on fd " << fd 
+                   << " failed, errno " << errno;
     }
 }
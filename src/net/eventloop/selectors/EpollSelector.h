@@ -13,13 +13,16 @@ public:
 private:
     int epoll_fd;
     EventList events;
+    int num_events = 0;
 
     void update(int op, int fd, int newevents = 0, void* pdata = nullptr);
+    static bool support_pwait2(int epoll_fd);
 public:
 
     EpollSelector(Selector::EventHandler && handler);
     ~EpollSelector() override;
-    virtual void select(int timeout) override;
+    virtual int select(chrono::nanoseconds timeout) override;
+    virtual void dispatch() override;
     virtual void add(int fd, int events, void* pdata) override;
     virtual void modify(int fd, int events, void* pdata) override;
     virtual void remove(int fd) override;
@@ -4,6 +4,8 @@
 #include "../../../utils/Common.h"
 #include <vector>
 #include <functional>
+#include <chrono>
+#include <atomic>
 
 using namespace std;
 
@@ -14,7 +16,13 @@ public:
     using EventHandler = function<void(void*, int events)>;
 protected:
     EventHandler handler;
+    bool precise = false;
+    // registered fds, read by other threads for load balancing
+    atomic<int> num_fds {0};
 public:
+    // or'ed into the events of add()/modify(): reported once per readiness
+    // change instead of as long as the fd is ready
+    static constexpr int EDGE = static_cast<int>(1u << 31);
     static int EPOLL_WAIT_TIMEOUT;
     static int EVENTS_LIST_SIZE;
     Selector(EventHandler && handler);
@@ -22,7 +30,14 @@ public:
     virtual void add(int fd, int events, void* pdata) = 0;
     virtual void modify(int fd, int events, void* pdata) = 0;
     virtual void remove(int fd) = 0;
-    virtual void select(int timeout = EPOLL_WAIT_TIMEOUT) = 0;
+    // wait for events, returns the number of ready events.
+    // a negative timeout blocks until any event arrives
+    virtual int select(chrono::nanoseconds timeout) = 0;
+    // run the handler for every ready event of the last select
+    virtual void dispatch() = 0;
     virtual int fd() = 0;
+    int size() const { return num_fds.load(memory_order_relaxed); }
+    // whether select() honours timeouts below one millisecond
+    bool precise_timeout() const { return precise; }
     static std::unique_ptr<Selector> create_selector(EventHandler && handler);
 };
\ No newline at end of file
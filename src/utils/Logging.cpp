@@ -0,0 +1,242 @@
+#include "Logging.h"
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+#include <cstdlib>
+
+using namespace std;
+
+
+namespace {
+
+struct RingHolder {
+    shared_ptr<LogRing> ring;
+    ~RingHolder() {
+        if (ring)
+            ring->detached = true;
+    }
+};
+
+thread_local RingHolder ring_holder;
+thread_local uint32_t cached_tid = 0;
+
+const char * level_names[] = {"TRACE", "DEBUG", "INFO ", "WARN ", "ERROR", "FATAL"};
+
+uint32_t current_tid() {
+    if (!cached_tid)
+        cached_tid = static_cast<uint32_t>(::syscall(SYS_gettid));
+    return cached_tid;
+}
+
+template <typename T>
+T load(const char * & p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return value;
+}
+
+}
+
+/**********************************LogRecord**********************************/
+
+LogRecord::LogRecord(LogLevel level, const char * file, int line)
+    : level(level) {
+    put(uint32_t(0));
+    put(static_cast<uint8_t>(level));
+    put(static_cast<uint32_t>(line));
+    put(current_tid());
+    put(static_cast<int64_t>(chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count()));
+    put(file);
+}
+
+LogRecord::~LogRecord() {
+    uint32_t size = static_cast<uint32_t>(len);
+    memcpy(buffer, &size, sizeof(size));
+    auto & ring = Logger::local_ring();
+    size_t used = ring.write(buffer, len);
+    if (used == 0 || used > ring.capacity() / 2)
+        Logger::instance().notify();
+    // callers rely on not returning, the record must not be dropped
+    if (level == LogLevel::FATAL) {
+        Logger::instance().flush();
+        if (used == 0 && ring.write(buffer, len))
+            Logger::instance().flush();
+        abort();
+    }
+}
+
+size_t LogRecord::format(const char * record, size_t len, string & out) {
+    if (len < HEADER_SIZE)
+        return 0;
+    const char * p = record;
+    uint32_t size = load<uint32_t>(p);
+    if (size < HEADER_SIZE || size > len)
+        return 0;
+    const char * end = record + size;
+    auto level = load<uint8_t>(p);
+    auto line = load<uint32_t>(p);
+    auto tid = load<uint32_t>(p);
+    auto time = load<int64_t>(p);
+    auto file = load<const char*>(p);
+
+    // records come in time order, the date part rarely changes
+    static thread_local time_t cached_secs = -1;
+    static thread_local char date[32];
+    time_t secs = static_cast<time_t>(time / 1000000000);
+    if (secs != cached_secs) {
+        tm t;
+        ::localtime_r(&secs, &t);
+        ::strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &t);
+        cached_secs = secs;
+    }
+    char usecs[16];
+    ::snprintf(usecs, sizeof(usecs), ".%06ld ",
+               static_cast<long>(time % 1000000000 / 1000));
+    out += date;
+    out += usecs;
+    out += level < 6 ? level_names[level] : "?????";
+    out += " " + to_string(tid) + " ";
+    if (const char * base = strrchr(file, '/'))
+        file = base + 1;
+    out += file;
+    out += ":" + to_string(line) + " - ";
+
+    while (p < end) {
+        char tag = *p++;
+        if (tag == INT && p + sizeof(int64_t) <= end) {
+            out += to_string(load<int64_t>(p));
+        }
+        else if (tag == UINT && p + sizeof(uint64_t) <= end) {
+            out += to_string(load<uint64_t>(p));
+        }
+        else if (tag == DOUBLE && p + sizeof(double) <= end) {
+            char buf[32];
+            ::snprintf(buf, sizeof(buf), "%.12g", load<double>(p));
+            out += buf;
+        }
+        else if (tag == CHAR && p + 1 <= end) {
+            out += *p++;
+        }
+        else if (tag == STRING && p + sizeof(uint32_t) <= end) {
+            auto slen = load<uint32_t>(p);
+            slen = min<size_t>(slen, end - p);
+            out.append(p, slen);
+            p += slen;
+        }
+        else {
+            break;
+        }
+    }
+    out += '\n';
+    return size;
+}
+
+/***********************************Logger************************************/
+
+Logger::Logger() : backend([this]() { run(); }) {}
+
+Logger::~Logger() {
+    running = false;
+    wakeup.notify_one();
+    if (backend.joinable())
+        backend.join();
+}
+
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+LogRing& Logger::local_ring() {
+    if (!ring_holder.ring) {
+        auto ring = make_shared<LogRing>(RING_SIZE);
+        auto & logger = instance();
+        lock_guard<mutex> lock(logger.rings_mutex);
+        logger.rings.push_back(ring);
+        logger.reported_drops.push_back(0);
+        ring_holder.ring = move(ring);
+    }
+    return *ring_holder.ring;
+}
+
+void Logger::set_output(int fd) {
+    output_fd = fd;
+}
+
+void Logger::notify() {
+    wakeup.notify_one();
+}
+
+void Logger::flush() {
+    drain();
+}
+
+void Logger::run() {
+    while (running) {
+        {
+            unique_lock<mutex> lock(wait_mutex);
+            wakeup.wait_for(lock, flush_interval);
+        }
+        drain();
+    }
+    drain();
+}
+
+void Logger::drain() {
+    lock_guard<mutex> drain_lock(drain_mutex);
+    string staged, block;
+    {
+        lock_guard<mutex> lock(rings_mutex);
+        for (size_t i = 0; i < rings.size(); ) {
+            auto & ring = *rings[i];
+            bool detached = ring.detached;
+            ring.read(staged);
+            if (uint64_t dropped = ring.dropped(); dropped != reported_drops[i]) {
+                block += to_string(dropped - reported_drops[i])
+                       + " log records dropped, staging ring full\n";
+                reported_drops[i] = dropped;
+            }
+            // the thread is gone and everything it staged has been read
+            if (detached) {
+                rings.erase(rings.begin() + i);
+                reported_drops.erase(reported_drops.begin() + i);
+            }
+            else {
+                i++;
+            }
+        }
+    }
+    if (staged.empty() && block.empty())
+        return;
+
+    // records of different threads are merged by time
+    vector<pair<int64_t, size_t>> records;
+    for (size_t pos = 0; pos + LogRecord::HEADER_SIZE <= staged.size(); ) {
+        const char * p = staged.data() + pos;
+        auto size = load<uint32_t>(p);
+        if (size < LogRecord::HEADER_SIZE)
+            break;
+        p += 1 + 4 + 4;
+        records.emplace_back(load<int64_t>(p), pos);
+        pos += size;
+    }
+    stable_sort(records.begin(), records.end(),
+                [](auto & a, auto & b) { return a.first < b.first; });
+    for (auto & [time, pos] : records) {
+        LogRecord::format(staged.data() + pos, staged.size() - pos, block);
+    }
+
+    int fd = output_fd;
+    for (size_t written = 0; written < block.size(); ) {
+        ssize_t n = ::write(fd, block.data() + written, block.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        written += n;
+    }
+}
@@ -1,83 +1,227 @@
 #pragma once
+#include "Common.h"
 #include <string.h>
-#include <type_traits>
-#include <string_view>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <algorithm>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 using namespace std;
 
-static const char digits[] = "0123456789ABCDEF";
 
-template <typename Ostream, size_t FSIZE = 4000>
-class LogStream {
-protected:
-    template <bool flag, typename T_>
-    using only = enable_if_t<flag, T_>;
-    using self = LogStream;
+// Records below this level are compiled out, see LOG().
+#ifndef NETYO_LOG_LEVEL
+#define NETYO_LOG_LEVEL 2
+#endif
 
-    Ostream ostream;
-    static char double_buffer[100], buffer[FSIZE];
-    size_t cur = 0;    
+enum class LogLevel : uint8_t {TRACE, DEBUG, INFO, WARN, ERROR, FATAL};
 
+
+// Lock free single producer single consumer byte ring, each logging thread
+// stages its records in its own ring which is drained by the logger's
+// background thread.
+class LogRing : public NoCopyble {
 public:
-    self& append(char * buffer, size_t len) {
-        if (sizeof(buffer) - cur < len) {
-            memcpy(buffer + cur, buffer, len);
-            *buffer++ = ' ';
-            cur += len + 1;
+    static constexpr size_t CACHELINE = 64;
+
+private:
+    vector<char> data;
+    const size_t mask;
+    // consumer side
+    alignas(CACHELINE) atomic<size_t> head {0};
+    // producer side
+    alignas(CACHELINE) atomic<size_t> tail {0};
+    atomic<uint64_t> _dropped {0};
+
+public:
+    // set when the producing thread exits, the ring is released once drained
+    atomic<bool> detached {false};
+
+    // the capacity must be a power of two
+    explicit LogRing(size_t capacity) : data(capacity), mask(capacity - 1) {}
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+    // producer only, all or nothing. Returns the bytes in use after writing,
+    // 0 if the record was dropped.
+    size_t write(const char * record, size_t len) {
+        size_t t = tail.load(memory_order_relaxed);
+        size_t used = t - head.load(memory_order_acquire);
+        if (capacity() - used < len) {
+            _dropped.store(_dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            return 0;
         }
-        return *this;
+        size_t pos = t & mask, len1 = min(len, capacity() - pos);
+        memcpy(data.data() + pos, record, len1);
+        memcpy(data.data(), record + len1, len - len1);
+        tail.store(t + len, memory_order_release);
+        return used + len;
     }
 
-    template<size_t N>
-    self& operator<<(const char s[N]) {
-        return append(s, N - 1);
+    // consumer only, appends everything staged to out
+    size_t read(string & out) {
+        size_t h = head.load(memory_order_relaxed);
+        size_t len = tail.load(memory_order_acquire) - h;
+        size_t pos = h & mask, len1 = min(len, capacity() - pos);
+        out.append(data.data() + pos, len1);
+        out.append(data.data(), len - len1);
+        head.store(h + len, memory_order_release);
+        return len;
     }
 
-    self& operator<<(const std::string & sv) {
-        return append(sv.data(), sv.size());
+    uint64_t dropped() const {
+        return _dropped.load(memory_order_relaxed);
     }
+};
+
+
+// Collects the records of all threads and writes them out from a background
+// thread in large blocks, logging threads never wait on the output.
+class Logger : public NoCopyble {
+public:
+    static constexpr size_t RING_SIZE = 1 << 20;
+
+private:
+    mutex rings_mutex;
+    vector<shared_ptr<LogRing>> rings;
+    vector<uint64_t> reported_drops;
+
+    // only one consumer may drain the rings at a time
+    mutex drain_mutex;
+    mutex wait_mutex;
+    condition_variable wakeup;
+    atomic<bool> running {true};
+    atomic<int> output_fd {2};
+    chrono::milliseconds flush_interval {50};
+    thread backend;
+
+    Logger();
+    void run();
+    void drain();
+
+public:
+    ~Logger();
+    static Logger& instance();
+
+    // ring of the calling thread, created on first use
+    static LogRing& local_ring();
+    // the fd is not owned, stderr by default
+    void set_output(int fd);
+    // called by producers when their ring fills up
+    void notify();
+    // write out everything staged so far, blocks the caller
+    void flush();
+};
+
+
+// One record, the arguments are encoded in binary and only formatted by the
+// background thread. Integers are copied as they are, strings by value.
+class LogRecord : public NoCopyble {
+public:
+    static constexpr size_t MAX_SIZE = 1024;
+    enum Tag : char {INT = 'i', UINT = 'u', DOUBLE = 'd', CHAR = 'c', STRING = 's'};
+
+    // size(uint32) | level(uint8) | line(uint32) | tid(uint32) |
+    // time(int64, ns since epoch) | file(const char*) | args...
+    static constexpr size_t HEADER_SIZE = 4 + 1 + 4 + 4 + 8 + sizeof(const char*);
+
+private:
+    LogLevel level;
+    size_t len = 0;
+    char buffer[MAX_SIZE];
 
     template <typename T>
-    only<is_integral<T>::value, self&> operator<<(T val) {
-        char * begin, * w;
-        begin = w = buffer + cur;
-        do {
-            int lsd = static_cast<int>(val % 10);
-            *w++ = digits[lsd]; val /= 10;
-        } while (val > 0);
-        if (val < 0) {
-            *w++ = '-';
+    void put(const T & value) {
+        if (len + sizeof(T) <= MAX_SIZE) {
+            memcpy(buffer + len, &value, sizeof(T));
+            len += sizeof(T);
         }
-        *w++ = ' ';
-        reverse(begin, w);
-        cur += w - begin;
-
-        return *this;
+    }
+    void put_tag(Tag tag, size_t size) {
+        // arguments which do not fit are truncated
+        if (len + 1 + size > MAX_SIZE)
+            len = MAX_SIZE;
+        else
+            buffer[len++] = tag;
     }
 
-    self& operator<<(const long double & val) {
-        int len = snprintf(double_buffer, 15, "%.12Lg", val);
-        if (sizeof(buffer) - cur < len) {
-            append(double_buffer, len);
+public:
+    LogRecord(LogLevel level, const char * file, int line);
+    ~LogRecord();
+
+    LogRecord& operator<<(string_view str) {
+        uint32_t size = static_cast<uint32_t>(
+            min(str.size(), MAX_SIZE - HEADER_SIZE));
+        put_tag(STRING, sizeof(size) + size);
+        if (len + sizeof(size) + size <= MAX_SIZE) {
+            put(size);
+            memcpy(buffer + len, str.data(), size);
+            len += size;
         }
         return *this;
     }
-
+    LogRecord& operator<<(const char * str) {
+        return *this << string_view(str ? str : "(null)");
+    }
+    LogRecord& operator<<(const string & str) {
+        return *this << string_view(str);
+    }
+    LogRecord& operator<<(char c) {
+        put_tag(CHAR, 1);
+        put(c);
+        return *this;
+    }
+    LogRecord& operator<<(bool b) {
+        return *this << (b ? "true" : "false");
+    }
     template <typename T>
-    only<is_floating_point<T>::value, self&> operator<<(T val) {
-        return *this << static_cast<long double>(val);
+    enable_if_t<is_integral_v<T> && is_signed_v<T>, LogRecord&> operator<<(T val) {
+        put_tag(INT, sizeof(int64_t));
+        put(static_cast<int64_t>(val));
+        return *this;
     }
-
-    template <typename T, size_t N, bool is_char = is_same<T, char>::value>
-    only<!is_char, self&> operator<<(const T (&array)[N]) {
-        for (int i = 0; i  < N; ++i)
-            *this << array[i];
-
+    template <typename T>
+    enable_if_t<is_integral_v<T> && is_unsigned_v<T>, LogRecord&> operator<<(T val) {
+        put_tag(UINT, sizeof(uint64_t));
+        put(static_cast<uint64_t>(val));
+        return *this;
+    }
+    template <typename T>
+    enable_if_t<is_floating_point_v<T>, LogRecord&> operator<<(T val) {
+        put_tag(DOUBLE, sizeof(double));
+        put(static_cast<double>(val));
         return *this;
     }
+    LogRecord& operator<<(const void * ptr) {
+        return *this << reinterpret_cast<uintptr_t>(ptr);
+    }
 
+    // formats one record, returns its size, 0 if it is malformed
+    static size_t format(const char * record, size_t len, string & out);
 };
 
-#define LOG ()
\ No newline at end of file
+// turns the streamed record into a void expression for LOG(): & binds looser
+// than << and tighter than ?:
+struct LogVoidify {
+    void operator&(const LogRecord &) {}
+};
+
+
+// LOG(ERROR) << "epoll_ctl failed, fd " << fd << " errno " << errno;
+// Levels below NETYO_LOG_LEVEL are discarded at compile time, the arguments
+// are not even evaluated. FATAL records are written out synchronously and
+// then abort the process. An expression, so brace-less if/else around it
+// binds as written.
+#define LOG(level)                                                          \
+    (static_cast<int>(LogLevel::level) < NETYO_LOG_LEVEL)                   \
+        ? (void) 0                                                          \
+        : LogVoidify() & LogRecord(LogLevel::level, __FILE__, __LINE__)
@@ -0,0 +1,218 @@
+#include "Metrics.h"
+
+using namespace std;
+
+
+static thread_local LoopMetrics * thread_metrics = nullptr;
+
+/******************************LatencyHistogram*******************************/
+
+void LatencyHistogram::Snapshot::merge(const LatencyHistogram & histogram) {
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        uint64_t n = histogram.counts[i].load(memory_order_relaxed);
+        counts[i] += n;
+        _count += n;
+    }
+    _sum += histogram._sum.value();
+    _max = std::max(_max, histogram._max.load(memory_order_relaxed));
+}
+
+void LatencyHistogram::Snapshot::merge(const Snapshot & other) {
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        counts[i] += other.counts[i];
+    }
+    _count += other._count;
+    _sum += other._sum;
+    _max = std::max(_max, other._max);
+}
+
+uint64_t LatencyHistogram::Snapshot::percentile(double q) const {
+    if (!_count)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(q * _count);
+    if (rank >= _count)
+        rank = _count - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen > rank) {
+            uint64_t upper = i + 1 < NUM_BUCKETS ? value_of(i + 1) - 1 : UINT64_MAX;
+            return std::min(upper, _max);
+        }
+    }
+    return _max;
+}
+
+/*******************************MetricsSnapshot*******************************/
+
+void MetricsSnapshot::add(const string & name, const string & help,
+                          const Counter & counter) {
+    auto & sample = samples[name];
+    sample.type = COUNTER;
+    sample.help = help;
+    sample.value += counter.value();
+}
+
+void MetricsSnapshot::add(const string & name, const string & help,
+                          const Gauge & gauge) {
+    auto & sample = samples[name];
+    sample.type = GAUGE;
+    sample.help = help;
+    sample.value += gauge.value();
+}
+
+void MetricsSnapshot::add(const string & name, const string & help,
+                          const Histogram & histogram) {
+    auto & sample = samples[name];
+    sample.type = HISTOGRAM;
+    sample.help = help;
+    sample.buckets.resize(Histogram::NUM_BUCKETS);
+    for (size_t i = 0; i < Histogram::NUM_BUCKETS; ++i) {
+        sample.buckets[i] += histogram.bucket(i);
+    }
+    sample.sum += histogram.sum();
+}
+
+void MetricsSnapshot::add(const string & name, const string & help,
+                          const LatencyHistogram & histogram) {
+    auto & sample = samples[name];
+    sample.type = SUMMARY;
+    sample.help = help;
+    sample.latency.merge(histogram);
+}
+
+void MetricsSnapshot::add(const string & name, const string & help,
+                          const LatencyHistogram::Snapshot & latency) {
+    auto & sample = samples[name];
+    sample.type = SUMMARY;
+    sample.help = help;
+    sample.latency.merge(latency);
+}
+
+uint64_t MetricsSnapshot::percentile(const string & name, double q) const {
+    auto it = samples.find(name);
+    return it == samples.end() ? 0 : it->second.latency.percentile(q);
+}
+
+string MetricsSnapshot::to_prometheus() const {
+    static const char * type_names[] = {"counter", "gauge", "histogram", "summary"};
+    string text;
+    for (auto & [name, sample] : samples) {
+        if (sample.help.size())
+            text += "# HELP " + name + " " + sample.help + "\n";
+        text += "# TYPE " + name + " " + type_names[sample.type] + "\n";
+        if (sample.type == SUMMARY) {
+            auto & latency = sample.latency;
+            for (auto q : {"0.5", "0.99", "0.999"}) {
+                text += name + "{quantile=\"" + q + "\"} " 
+                      + to_string(latency.percentile(stod(q))) + "\n";
+            }
+            text += name + "{quantile=\"1\"} " + to_string(latency.max()) + "\n";
+            text += name + "_sum " + to_string(latency.sum()) + "\n";
+            text += name + "_count " + to_string(latency.count()) + "\n";
+            continue;
+        }
+        if (sample.type != HISTOGRAM) {
+            text += name + " " + to_string(sample.value) + "\n";
+            continue;
+        }
+        // skip the empty tail, values of bit width i are at most 2^i - 1
+        size_t last = sample.buckets.size();
+        while (last > 1 && sample.buckets[last - 1] == 0)
+            last--;
+        uint64_t count = 0;
+        for (size_t i = 0; i < last; ++i) {
+            count += sample.buckets[i];
+            uint64_t le = i + 1 < Histogram::NUM_BUCKETS 
+                        ? (uint64_t(1) << i) - 1 : UINT64_MAX;
+            text += name + "_bucket{le=\"" + to_string(le) + "\"} "
+                  + to_string(count) + "\n";
+        }
+        text += name + "_bucket{le=\"+Inf\"} " + to_string(count) + "\n";
+        text += name + "_sum " + to_string(sample.sum) + "\n";
+        text += name + "_count " + to_string(count) + "\n";
+    }
+    return text;
+}
+
+/*********************************LoopMetrics*********************************/
+
+LoopMetrics& LoopMetrics::local() {
+    if (thread_metrics)
+        return *thread_metrics;
+    static thread_local LoopMetrics detached;
+    return detached;
+}
+
+void LoopMetrics::attach() {
+    thread_metrics = this;
+}
+
+void LoopMetrics::detach() {
+    if (thread_metrics == this)
+        thread_metrics = nullptr;
+}
+
+Counter& LoopMetrics::counter(const string & name, const string & help) {
+    lock_guard<mutex> lock(families_mutex);
+    auto & family = families[name];
+    if (!family.counter) {
+        family.help = help;
+        family.counter.reset(new Counter);
+    }
+    return *family.counter;
+}
+
+Gauge& LoopMetrics::gauge(const string & name, const string & help) {
+    lock_guard<mutex> lock(families_mutex);
+    auto & family = families[name];
+    if (!family.gauge) {
+        family.help = help;
+        family.gauge.reset(new Gauge);
+    }
+    return *family.gauge;
+}
+
+Histogram& LoopMetrics::histogram(const string & name, const string & help) {
+    lock_guard<mutex> lock(families_mutex);
+    auto & family = families[name];
+    if (!family.histogram) {
+        family.help = help;
+        family.histogram.reset(new Histogram);
+    }
+    return *family.histogram;
+}
+
+void LoopMetrics::collect(MetricsSnapshot & snapshot) const {
+    snapshot.add("netyo_loop_wakeups_total", "select() returns", wakeups);
+    snapshot.add("netyo_loop_events_total", "ready events dispatched", events);
+    snapshot.add("netyo_loop_events_per_wakeup", "ready events per select()",
+                 events_per_wakeup);
+    snapshot.add("netyo_loop_tasks_run_total", "queued tasks executed", tasks_run);
+    snapshot.add("netyo_loop_timers_fired_total", "timer callbacks run", timers_fired);
+    snapshot.add("netyo_bytes_read_total", "bytes read from sockets", bytes_read);
+    snapshot.add("netyo_bytes_written_total", "bytes written to sockets", bytes_written);
+    snapshot.add("netyo_socket_accepts_total", "accepted sockets", accepts);
+    snapshot.add("netyo_socket_closes_total", "closed sockets", closes);
+    snapshot.add("netyo_accepts_dropped_total", "connections closed right after accept", accepts_dropped);
+    snapshot.add("netyo_accepts_deferred_total", "times accepting paused", accepts_deferred);
+    snapshot.add("netyo_epoll_ctl_total", "epoll_ctl calls", epoll_ctls);
+    snapshot.add("netyo_loop_migrations_in_total", "transports moved to the loop", migrations_in);
+    snapshot.add("netyo_loop_migrations_out_total", "transports moved off the loop", migrations_out);
+    snapshot.add("netyo_buffer_bytes", "bytes allocated by buffers", buffer_bytes);
+    snapshot.add("netyo_loop_task_delay_ns", "call_soon enqueue to execution", task_delay);
+    snapshot.add("netyo_loop_timer_lag_ns", "timer deadline to firing", timer_lag);
+    snapshot.add("netyo_handler_time_ns", "data_received_cb duration", handler_time);
+    snapshot.add("netyo_first_write_latency_ns", 
+                 "read readiness to the first response write", first_write_latency);
+
+    lock_guard<mutex> lock(families_mutex);
+    for (auto & [name, family] : families) {
+        if (family.counter)
+            snapshot.add(name, family.help, *family.counter);
+        if (family.gauge)
+            snapshot.add(name, family.help, *family.gauge);
+        if (family.histogram)
+            snapshot.add(name, family.help, *family.histogram);
+    }
+}
@@ -0,0 +1,223 @@
+#pragma once
+#include "Common.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+
+// Single writer metrics: only the owning loop's thread updates them, with
+// relaxed loads and stores instead of read-modify-write atomics, so an update
+// costs a plain add. Any thread may read them.
+class Counter {
+private:
+    atomic<uint64_t> v {0};
+public:
+    void inc(uint64_t n = 1) {
+        v.store(v.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+    uint64_t value() const {
+        return v.load(memory_order_relaxed);
+    }
+};
+
+class Gauge {
+private:
+    atomic<int64_t> v {0};
+public:
+    void set(int64_t value) {
+        v.store(value, memory_order_relaxed);
+    }
+    void add(int64_t n) {
+        v.store(v.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+    int64_t value() const {
+        return v.load(memory_order_relaxed);
+    }
+};
+
+// Bucket i counts the values of bit width i, i.e. values in [2^(i-1), 2^i),
+// the last one also takes everything above.
+class Histogram {
+public:
+    static constexpr size_t NUM_BUCKETS = 64;
+private:
+    atomic<uint64_t> buckets[NUM_BUCKETS] {};
+    Counter _sum;
+public:
+    void observe(uint64_t value) {
+        size_t i = min<size_t>(bit_width(value), NUM_BUCKETS - 1);
+        auto & bucket = buckets[i];
+        bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        _sum.inc(value);
+    }
+    uint64_t bucket(size_t i) const {
+        return buckets[i].load(memory_order_relaxed);
+    }
+    uint64_t sum() const {
+        return _sum.value();
+    }
+};
+
+
+// HDR style latency histogram: every power of two range is split into
+// SUB_BUCKETS linear buckets, so values are kept with ~3% relative error
+// over the whole uint64 range at a fixed cost of one index computation.
+class LatencyHistogram {
+public:
+    static constexpr size_t SUB_BITS = 6, SUB_BUCKETS = 1 << (SUB_BITS - 1),
+                            NUM_BUCKETS = (64 - SUB_BITS + 2) * SUB_BUCKETS;
+
+    // merged counts, e.g. of all loops
+    class Snapshot {
+    private:
+        vector<uint64_t> counts;
+        uint64_t _count = 0, _sum = 0, _max = 0;
+    public:
+        Snapshot() : counts(NUM_BUCKETS) {}
+        void merge(const LatencyHistogram & histogram);
+        void merge(const Snapshot & other);
+        uint64_t count() const { return _count; }
+        uint64_t sum() const { return _sum; }
+        uint64_t max() const { return _max; }
+        // the upper bound of the bucket holding the q-th(0 to 1) value
+        uint64_t percentile(double q) const;
+    };
+
+private:
+    atomic<uint64_t> counts[NUM_BUCKETS] {};
+    Counter _sum;
+    atomic<uint64_t> _max {0};
+
+public:
+    static size_t index_of(uint64_t value) {
+        size_t width = bit_width(value);
+        if (width <= SUB_BITS)
+            return value;
+        size_t shift = width - SUB_BITS;
+        return shift * SUB_BUCKETS + (value >> shift);
+    }
+    // the smallest value of the bucket
+    static uint64_t value_of(size_t index) {
+        if (index < 2 * SUB_BUCKETS)
+            return index;
+        size_t shift = index / SUB_BUCKETS - 1;
+        return static_cast<uint64_t>(index - shift * SUB_BUCKETS) << shift;
+    }
+
+    // single writer, like Counter
+    void record(uint64_t value) {
+        auto & bucket = counts[index_of(value)];
+        bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        _sum.inc(value);
+        if (value > _max.load(memory_order_relaxed))
+            _max.store(value, memory_order_relaxed);
+    }
+    Snapshot snapshot() const {
+        Snapshot snap;
+        snap.merge(*this);
+        return snap;
+    }
+};
+
+
+// Metrics merged from any number of loops, e.g. for an export.
+class MetricsSnapshot {
+public:
+    enum Type {COUNTER, GAUGE, HISTOGRAM, SUMMARY};
+    struct Sample {
+        Type type;
+        string help;
+        int64_t value = 0;
+        // histograms only
+        vector<uint64_t> buckets;
+        uint64_t sum = 0;
+        // summaries only
+        LatencyHistogram::Snapshot latency;
+    };
+    map<string, Sample> samples;
+
+    void add(const string & name, const string & help, const Counter & counter);
+    void add(const string & name, const string & help, const Gauge & gauge);
+    void add(const string & name, const string & help, const Histogram & histogram);
+    // exported as a summary with p50/p99/p999 and max(quantile 1)
+    void add(const string & name, const string & help, const LatencyHistogram & histogram);
+    void add(const string & name, const string & help,
+             const LatencyHistogram::Snapshot & latency);
+    // 0 for unknown metrics
+    uint64_t percentile(const string & name, double q) const;
+    // prometheus text exposition format
+    string to_prometheus() const;
+};
+
+
+// The metrics of one loop. Loops attach theirs to their thread so that
+// code without access to the loop(buffers, sockets, selectors) reaches it
+// through local().
+class LoopMetrics : public NoCopyble {
+public:
+    Counter wakeups, events, tasks_run, timers_fired,
+            bytes_read, bytes_written, accepts, closes, epoll_ctls,
+            migrations_in, migrations_out, accepts_dropped, accepts_deferred;
+    // allocated by Buffers
+    Gauge buffer_bytes;
+    Histogram events_per_wakeup;
+    // nanoseconds: call_soon enqueue to execution, timer deadline to firing,
+    // data_received_cb runs and read readiness to the first response write.
+    // All but timer_lag are sampled, see sample_latency().
+    LatencyHistogram task_delay, timer_lag, handler_time, first_write_latency;
+
+    // one in LATENCY_SAMPLE_RATE events of the calling thread on average
+    // reads the clock, a read per event costs as much as a small handler. The
+    // gaps are random, events taking turns(e.g. both ends of a connection
+    // within one loop) would alias with a fixed one.
+    static constexpr uint32_t LATENCY_SAMPLE_RATE = 64;
+    bool sample_latency() {
+        if (--latency_gap)
+            return false;
+        // xorshift32
+        sample_seed ^= sample_seed << 13;
+        sample_seed ^= sample_seed >> 17;
+        sample_seed ^= sample_seed << 5;
+        latency_gap = 1 + sample_seed % (2 * LATENCY_SAMPLE_RATE - 1);
+        return true;
+    }
+
+private:
+    uint32_t latency_gap = 1, sample_seed = 2463534242u;
+
+    struct Family {
+        string help;
+        unique_ptr<Counter> counter;
+        unique_ptr<Gauge> gauge;
+        unique_ptr<Histogram> histogram;
+    };
+    // registration is rare, the mutex only guards against collect()
+    mutable mutex families_mutex;
+    map<string, Family> families;
+
+public:
+    LoopMetrics() = default;
+
+    // metrics of the loop running in the calling thread, threads without a
+    // loop get their own detached instance which is never collected.
+    static LoopMetrics& local();
+    void attach();
+    void detach();
+
+    // user defined metrics of the loop, registered once within the loop's
+    // thread, the references stay valid as long as the loop.
+    Counter& counter(const string & name, const string & help = "");
+    Gauge& gauge(const string & name, const string & help = "");
+    Histogram& histogram(const string & name, const string & help = "");
+
+    // safe to call from any thread
+    void collect(MetricsSnapshot & snapshot) const;
+};
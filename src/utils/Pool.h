@@ -0,0 +1,153 @@
+#pragma once
+#include "Common.h"
+#include <atomic>
+#include <memory>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+
+using namespace std;
+
+
+// Free list of fixed size blocks owned by one thread(loop). The owner
+// allocates and frees without any synchronization, blocks freed by other
+// threads are pushed onto a lock free stack which the owner takes over once
+// its own list runs dry.
+class BlockPool : public NoCopyble {
+private:
+    struct Block {
+        Block * next;
+    };
+    const size_t block_size;
+    const size_t max_free;
+    const thread::id owner;
+    Block * free_list = nullptr;
+    size_t num_free = 0;
+    atomic<Block*> remote {nullptr};
+
+    static void release(Block * block) {
+        while (block) {
+            Block * next = block->next;
+            ::operator delete(block);
+            block = next;
+        }
+    }
+
+public:
+    // up to max_bytes of free blocks are kept
+    BlockPool(size_t block_size, size_t max_bytes = 4 << 20)
+        : block_size(max(block_size, sizeof(Block))),
+          max_free(max_bytes / max(block_size, sizeof(Block))),
+          owner(this_thread::get_id()) {}
+
+    ~BlockPool() {
+        release(free_list);
+        release(remote.load(memory_order_acquire));
+    }
+
+    // the pool of the calling thread for blocks of size bytes, created on
+    // first use. Allocators share its ownership, so blocks handed out stay
+    // valid after the thread exits.
+    static shared_ptr<BlockPool> local(size_t size) {
+        static thread_local vector<shared_ptr<BlockPool>> pools;
+        for (auto & pool : pools) {
+            if (pool->block_size == size)
+                return pool;
+        }
+        return pools.emplace_back(make_shared<BlockPool>(size));
+    }
+
+    size_t size() const {
+        return block_size;
+    }
+
+    void* allocate() {
+        // e.g. an allocator copied to another thread
+        if (this_thread::get_id() != owner)
+            return ::operator new(block_size);
+        if (!free_list) {
+            free_list = remote.exchange(nullptr, memory_order_acquire);
+            num_free = 0;
+        }
+        if (!free_list)
+            return ::operator new(block_size);
+        Block * block = free_list;
+        free_list = block->next;
+        if (num_free)
+            num_free--;
+        return block;
+    }
+
+    void deallocate(void * p) {
+        Block * block = static_cast<Block*>(p);
+        if (this_thread::get_id() != owner) {
+            block->next = remote.load(memory_order_relaxed);
+            while (!remote.compare_exchange_weak(block->next, block,
+                                                 memory_order_release,
+                                                 memory_order_relaxed)) {}
+        }
+        else if (num_free < max_free) {
+            block->next = free_list;
+            free_list = block;
+            num_free++;
+        }
+        else {
+            ::operator delete(block);
+        }
+    }
+};
+
+
+// Single objects come from a BlockPool, e.g. allocate_shared(PoolAllocator<T>(),
+// ...) places the object and its control block into one recycled block.
+// An allocator binds to the pool of the thread it first allocates from, so
+// a container created elsewhere still recycles the nodes of the loop using
+// it, an unbound one(e.g. rebound by allocate_shared) frees into the pool of
+// the deallocating thread. Blocks are plain heap blocks of sizeof(T) bytes,
+// any pool of that size takes them back, so allocators compare equal. Arrays
+// fall back to the global heap.
+template <typename T>
+class PoolAllocator {
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+                  "over aligned types are not supported");
+
+    template <typename U>
+    friend class PoolAllocator;
+
+    shared_ptr<BlockPool> pool;
+
+public:
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> & other)
+        : pool(sizeof(T) == sizeof(U) ? other.pool : nullptr) {}
+
+    T* allocate(size_t n) {
+        if (n != 1)
+            return allocator<T>().allocate(n);
+        if (!pool)
+            pool = BlockPool::local(sizeof(T));
+        return static_cast<T*>(pool->allocate());
+    }
+    void deallocate(T * p, size_t n) {
+        if (n != 1)
+            allocator<T>().deallocate(p, n);
+        else if (pool)
+            pool->deallocate(p);
+        else
+            BlockPool::local(sizeof(T))->deallocate(p);
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U> &) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U> &) const {
+        return false;
+    }
+};
@@ -0,0 +1,110 @@
+#include "Trace.h"
+#include <bit>
+#include <stdio.h>
+
+using namespace std;
+
+
+static thread_local Tracer * thread_tracer = nullptr;
+
+static const char * type_names[] = {"select", "dispatch", "task", "timer", "accept", "close"};
+static const char * arg_names[] = {"events", "fd", nullptr, "id", "fd", "fd"};
+
+Tracer& Tracer::local() {
+    if (thread_tracer)
+        return *thread_tracer;
+    static thread_local Tracer detached;
+    return detached;
+}
+
+void Tracer::attach() {
+    thread_tracer = this;
+}
+
+void Tracer::detach() {
+    if (thread_tracer == this)
+        thread_tracer = nullptr;
+}
+
+void Tracer::start(size_t capacity) {
+    capacity = bit_ceil(max<size_t>(capacity, 2));
+    ring.assign(capacity, TraceEvent{});
+    mask = capacity - 1;
+    next = 0;
+    cursor = clock();
+}
+
+void Tracer::stop() {
+    ring.clear();
+    ring.shrink_to_fit();
+    mask = 0;
+    next = 0;
+}
+
+vector<TraceEvent> Tracer::events() const {
+    vector<TraceEvent> res;
+    if (!enabled())
+        return res;
+    uint64_t first = next > ring.size() ? next - ring.size() : 0;
+    res.reserve(next - first);
+    for (uint64_t i = first; i < next; ++i)
+        res.push_back(ring[i & mask]);
+    return res;
+}
+
+string Tracer::to_chrome_json(const vector<pair<string, vector<TraceEvent>>> & timelines) {
+    ChromeTraceWriter writer;
+    for (size_t tid = 0; tid < timelines.size(); ++tid) {
+        auto & [name, events] = timelines[tid];
+        writer.thread_name(tid, name);
+        writer.add(tid, events.data(), events.size());
+    }
+    return writer.finish();
+}
+
+/*******************************ChromeTraceWriter*****************************/
+
+void ChromeTraceWriter::append(const char * buf, int len, size_t size) {
+    if (!first)
+        json += ',';
+    json.append(buf, min<size_t>(len, size - 1));
+    first = false;
+}
+
+void ChromeTraceWriter::thread_name(size_t tid, const string & name) {
+    char buf[256];
+    append(buf, ::snprintf(buf, sizeof(buf),
+        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+        "\"args\":{\"name\":\"%s\"}}", tid, name.c_str()), sizeof(buf));
+}
+
+void ChromeTraceWriter::add(size_t tid, const TraceEvent * events, size_t num) {
+    char buf[256], args[64];
+    for (size_t i = 0; i < num; ++i) {
+        auto & e = events[i];
+        auto type = static_cast<size_t>(e.type);
+        if (type >= size(type_names))
+            continue;
+        args[0] = '\0';
+        if (arg_names[type])
+            ::snprintf(args, sizeof(args), "\"%s\":%d", arg_names[type], e.arg);
+        // timestamps are in microseconds
+        if (e.type == TraceType::ACCEPT || e.type == TraceType::CLOSE) {
+            append(buf, ::snprintf(buf, sizeof(buf),
+                "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%zu,"
+                "\"ts\":%.3f,\"args\":{%s}}",
+                type_names[type], tid, e.ts / 1e3, args), sizeof(buf));
+        }
+        else {
+            append(buf, ::snprintf(buf, sizeof(buf),
+                "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{%s}}",
+                type_names[type], tid, e.ts / 1e3, e.dur / 1e3, args), sizeof(buf));
+        }
+    }
+}
+
+string ChromeTraceWriter::finish() {
+    json += "]}";
+    return move(json);
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include "Common.h"
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+
+// The tracer is compiled in with -DNETYO_TRACE=1, see TRACE().
+#ifndef NETYO_TRACE
+#define NETYO_TRACE 0
+#endif
+
+enum class TraceType : uint8_t {SELECT, DISPATCH, TASK, TIMER, ACCEPT, CLOSE};
+
+struct TraceEvent {
+    // steady clock, in ns
+    int64_t ts;
+    // 0 for instant events
+    int64_t dur;
+    // the number of events for SELECT, the timer id for TIMER, unused for
+    // TASK and the fd otherwise
+    int32_t arg;
+    TraceType type;
+};
+
+
+// Timeline of the latest events of one loop, only the loop's thread records
+// into it. Events are laid out back to back: each one starts where the
+// previous one ended, the loop's cached clock after select() returned or the
+// clock read at the end of the last complete event, so recording costs at
+// most one clock read.
+class Tracer : public NoCopyble {
+private:
+    // empty while tracing is stopped
+    vector<TraceEvent> ring;
+    size_t mask = 0;
+    uint64_t next = 0;
+    int64_t cursor = 0;
+
+    static int64_t clock() {
+        return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    // the tracer of the loop running in the calling thread, a disabled one
+    // for threads without a loop.
+    static Tracer& local();
+    void attach();
+    void detach();
+
+    // within the loop's thread, the capacity is rounded up to a power of two.
+    // Starting again drops the events recorded so far.
+    void start(size_t capacity = 1 << 16);
+    void stop();
+    bool enabled() const {
+        return mask;
+    }
+
+    void record(TraceType type, int32_t arg, int64_t ts, int64_t dur) {
+        ring[next++ & mask] = TraceEvent{ts, dur, arg, type};
+    }
+    // the start of the next event
+    int64_t mark() const {
+        return cursor;
+    }
+    // from the end of the last event up to time, e.g. select() returning
+    void complete(TraceType type, int32_t arg, const chrono::steady_clock::time_point & time) {
+        int64_t now = chrono::duration_cast<chrono::nanoseconds>(
+            time.time_since_epoch()).count();
+        record(type, arg, cursor, now - cursor);
+        cursor = now;
+    }
+    // from a mark() up to now, enclosing the events recorded in between
+    void complete_since(int64_t start, TraceType type, int32_t arg) {
+        int64_t now = clock();
+        record(type, arg, start, now - start);
+        cursor = now;
+    }
+    // from the end of the last event up to now
+    void complete(TraceType type, int32_t arg) {
+        int64_t now = clock();
+        record(type, arg, cursor, now - cursor);
+        cursor = now;
+    }
+    void instant(TraceType type, int32_t arg) {
+        record(type, arg, cursor, 0);
+    }
+
+    // within the loop's thread, oldest first
+    vector<TraceEvent> events() const;
+
+    // chrome trace_event JSON(chrome://tracing, perfetto), one thread per
+    // timeline.
+    static string to_chrome_json(const vector<pair<string, vector<TraceEvent>>> & timelines);
+};
+
+
+// Builds the JSON of Tracer::to_chrome_json() piece by piece, e.g. a few
+// thousand events per loop iteration.
+class ChromeTraceWriter {
+private:
+    string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+
+    void append(const char * buf, int len, size_t size);
+
+public:
+    // once per timeline, before its events
+    void thread_name(size_t tid, const string & name);
+    void add(size_t tid, const TraceEvent * events, size_t num);
+    // once, after the last timeline
+    string finish();
+};
+
+
+// TRACE(complete(TraceType::TASK, 0));
+// Records into the calling thread's tracer while it is started, compiled out
+// entirely unless NETYO_TRACE is set.
+#define TRACE(call)                                                         \
+    if constexpr (!NETYO_TRACE) {}                                          \
+    else if (auto & _tracer = Tracer::local(); _tracer.enabled())           \
+        _tracer.call
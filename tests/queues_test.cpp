@@ -0,0 +1,160 @@
+// The lock-free queues and the block pool under a concurrent producer and
+// consumer, run by ctest.
+#include "net/eventloop/MpscQueue.h"
+#include "net/eventloop/SpscQueue.h"
+#include "utils/Pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                    __FILE__, __LINE__, #cond);                             \
+            exit(1);                                                        \
+        }                                                                   \
+    } while (0)
+
+
+static void test_spsc() {
+    SpscQueue<size_t> full(3);
+    CHECK(full.capacity() == 4);
+    for (size_t i = 0; i < 4; ++i)
+        CHECK(full.push(i));
+    CHECK(!full.push(4));
+
+    // a small ring, so both sides keep running into each other
+    constexpr size_t N = 1 << 20;
+    SpscQueue<size_t> queue(64);
+    thread producer([&queue]() {
+        for (size_t i = 0; i < N; ) {
+            if (queue.push(i))
+                i++;
+            else
+                this_thread::yield();
+        }
+    });
+    size_t expected = 0;
+    while (expected < N) {
+        size_t value;
+        // alternate between single pops and batches
+        if (expected % 2 && queue.pop(value)) {
+            CHECK(value == expected);
+            expected++;
+        }
+        else if (!queue.consume([&expected](size_t && value) {
+                     CHECK(value == expected);
+                     expected++;
+                 }, 16)) {
+            this_thread::yield();
+        }
+    }
+    producer.join();
+    CHECK(queue.empty());
+}
+
+static void test_mpsc() {
+    constexpr size_t PRODUCERS = 4, N = 1 << 18;
+    MpscQueue<pair<size_t, size_t>> queue;
+    vector<thread> producers;
+    for (size_t p = 0; p < PRODUCERS; ++p) {
+        producers.emplace_back([&queue, p]() {
+            for (size_t i = 0; i < N; ++i)
+                queue.enqueue(make_pair(p, i));
+        });
+    }
+    // every producer's items arrive in its own order
+    vector<size_t> next(PRODUCERS);
+    for (size_t received = 0; received < PRODUCERS * N; ) {
+        pair<size_t, size_t> item;
+        if (!queue.dequeue(item)) {
+            this_thread::yield();
+            continue;
+        }
+        CHECK(item.first < PRODUCERS);
+        CHECK(item.second == next[item.first]);
+        next[item.first]++;
+        received++;
+    }
+    for (auto & producer : producers)
+        producer.join();
+    pair<size_t, size_t> item;
+    CHECK(!queue.dequeue(item));
+
+    // what is left is destroyed with the queue
+    auto value = make_shared<int>(1);
+    {
+        MpscQueue<shared_ptr<int>> leftover;
+        leftover.enqueue(value);
+        leftover.enqueue(value);
+        CHECK(value.use_count() == 3);
+    }
+    CHECK(value.use_count() == 1);
+}
+
+static void test_pool() {
+    constexpr size_t N = 4096;
+    BlockPool pool(64);
+    vector<void*> blocks;
+    for (size_t i = 0; i < N; ++i)
+        blocks.push_back(pool.allocate());
+    set<void*> allocated(blocks.begin(), blocks.end());
+    CHECK(allocated.size() == N);
+
+    // freed by several threads at once onto the remote stack
+    vector<thread> freeing;
+    for (size_t t = 0; t < 4; ++t) {
+        freeing.emplace_back([&pool, &blocks, t]() {
+            for (size_t i = t; i < N; i += 4)
+                pool.deallocate(blocks[i]);
+        });
+    }
+    for (auto & thread : freeing)
+        thread.join();
+    // the owner takes every one of them back
+    for (auto & block : blocks) {
+        block = pool.allocate();
+        CHECK(allocated.erase(block) == 1);
+    }
+    CHECK(allocated.empty());
+    for (auto block : blocks)
+        pool.deallocate(block);
+
+    // objects allocated on one thread and released on another, which keeps
+    // the blocks in its own pool
+    constexpr size_t OBJECTS = 1 << 16;
+    SpscQueue<shared_ptr<size_t>> handoff(256);
+    thread consumer([&handoff]() {
+        for (size_t i = 0; i < OBJECTS; ) {
+            shared_ptr<size_t> object;
+            if (!handoff.pop(object)) {
+                this_thread::yield();
+                continue;
+            }
+            CHECK(*object == i);
+            object.reset();
+            i++;
+        }
+    });
+    for (size_t i = 0; i < OBJECTS; ) {
+        if (handoff.push(allocate_shared<size_t>(PoolAllocator<size_t>(), i)))
+            i++;
+        else
+            this_thread::yield();
+    }
+    consumer.join();
+}
+
+int main() {
+    test_spsc();
+    test_mpsc();
+    test_pool();
+    printf("ok\n");
+    return 0;
+}